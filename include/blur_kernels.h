@@ -0,0 +1,423 @@
+#ifndef BLUR_KERNELS_H
+#define BLUR_KERNELS_H
+
+#include "cpu_dispatch.h"
+#include "gif_math.h"
+#include "gif_model.h"
+#include "split.h"
+#include <omp.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Largest radius with its own fully unrolled blur kernel
+#define BLUR_MAX_SPECIALIZED_RADIUS 8
+
+// Rows touched by blur: [top_begin, top_end) and [bottom_begin, bottom_end)
+typedef struct blur_bands {
+  int top_begin, top_end;
+  int bottom_begin, bottom_end;
+} blur_bands;
+
+static inline blur_bands blur_band_rows(int height, int size) {
+  blur_bands bands = {size, height / 10 - size, (int)(height * 0.9) + size,
+                      height - size};
+  if (bands.top_end < bands.top_begin)
+    bands.top_end = bands.top_begin;
+  if (bands.bottom_end < bands.bottom_begin)
+    bands.bottom_end = bands.bottom_begin;
+  return bands;
+}
+
+// Blur columns [x0, x1) of one row from its 2 * SIZE + 1 input rows lines
+// into out (which may be the row itself), old being the row's input values.
+// Evaluates to whether every pixel stayed within threshold.
+#define BLUR_ROW_BODY(SIZE)                                                    \
+  const int denom = (2 * (SIZE) + 1) * (2 * (SIZE) + 1);                       \
+  int row_end = 1;                                                             \
+                                                                               \
+  for (int k = x0; k < x1; k++) {                                              \
+    int t_r = 0, t_g = 0, t_b = 0;                                             \
+                                                                               \
+    _Pragma("GCC unroll 17")                                                   \
+    for (int s = 0; s <= 2 * (SIZE); s++) {                                    \
+      const pixel *line = &lines[s][k];                                        \
+      _Pragma("GCC unroll 17")                                                 \
+      for (int stencil_k = -(SIZE); stencil_k <= (SIZE); stencil_k++) {        \
+        t_r += line[stencil_k].r;                                              \
+        t_g += line[stencil_k].g;                                              \
+        t_b += line[stencil_k].b;                                              \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    pixel prev = old[k];                                                       \
+    pixel res = {(unsigned char)(t_r / denom), (unsigned char)(t_g / denom),   \
+                 (unsigned char)(t_b / denom)};                                \
+    out[k] = res;                                                              \
+                                                                               \
+    row_end &= abs(res.r - prev.r) <= threshold &&                             \
+               abs(res.g - prev.g) <= threshold &&                             \
+               abs(res.b - prev.b) <= threshold;                               \
+  }                                                                            \
+                                                                               \
+  return row_end;
+
+typedef int (*blur_row_fn)(const pixel *const *lines, const pixel *old,
+                           pixel *out, int x0, int x1, int size,
+                           int threshold);
+
+// Every row kernel exists once per instruction set (see cpu_dispatch.h): the
+// generic one for radii without a specialized kernel, and one per radius up
+// to BLUR_MAX_SPECIALIZED_RADIUS.
+#define DEFINE_BLUR_ROW_VARIANT(NAME, ATTR, SIZE)                              \
+  ATTR static inline int NAME(const pixel *const *lines, const pixel *old,     \
+                              pixel *out, int x0, int x1, int size,            \
+                              int threshold) {                                 \
+    (void)size;                                                                \
+    BLUR_ROW_BODY(SIZE)                                                        \
+  }
+
+#define DEFINE_BLUR_ROW(SUFFIX, SIZE)                                          \
+  DEFINE_BLUR_ROW_VARIANT(blur_row_##SUFFIX, , SIZE)                           \
+  DEFINE_BLUR_ROW_VARIANT(blur_row_##SUFFIX##_avx2, KERNEL_TARGET_AVX2, SIZE)  \
+  DEFINE_BLUR_ROW_VARIANT(blur_row_##SUFFIX##_avx512, KERNEL_TARGET_AVX512,    \
+                          SIZE)
+
+DEFINE_BLUR_ROW(generic, size)
+DEFINE_BLUR_ROW(r1, 1)
+DEFINE_BLUR_ROW(r2, 2)
+DEFINE_BLUR_ROW(r3, 3)
+DEFINE_BLUR_ROW(r4, 4)
+DEFINE_BLUR_ROW(r5, 5)
+DEFINE_BLUR_ROW(r6, 6)
+DEFINE_BLUR_ROW(r7, 7)
+DEFINE_BLUR_ROW(r8, 8)
+
+#define BLUR_ROW_TABLE(ISA)                                                    \
+  {                                                                            \
+    blur_row_generic##ISA, blur_row_r1##ISA, blur_row_r2##ISA,                 \
+        blur_row_r3##ISA, blur_row_r4##ISA, blur_row_r5##ISA,                  \
+        blur_row_r6##ISA, blur_row_r7##ISA, blur_row_r8##ISA                   \
+  }
+
+// Pick the blur row kernel for a given radius and the active ISA. Entry 0 of
+// each row is the generic kernel.
+static inline blur_row_fn blur_select_row(int size) {
+  static const blur_row_fn kernels[KERNEL_ISA_COUNT]
+                                  [BLUR_MAX_SPECIALIZED_RADIUS + 1] = {
+                                      BLUR_ROW_TABLE(),
+                                      BLUR_ROW_TABLE(_avx2),
+                                      BLUR_ROW_TABLE(_avx512),
+                                  };
+
+  const blur_row_fn *row = kernels[kernel_isa()];
+  if (size >= 1 && size <= BLUR_MAX_SPECIALIZED_RADIUS) {
+    return row[size];
+  }
+  return row[0];
+}
+
+// Rows a thread keeps while blurring in place, all full width: a ring of its
+// last size + 1 input rows, and per band the size input rows above and below
+// its share, saved before anyone writes. (5 * size + 1) rows in all.
+typedef struct blur_scratch {
+  pixel *ring;
+  pixel *head[2];
+  pixel *tail[2];
+  const pixel **lines;
+} blur_scratch;
+
+// Lay the rows out for width and size, which may be smaller than the ones
+// the scratch was allocated for: a scratch can then be reused for frames of
+// different sizes.
+static inline void blur_scratch_layout(blur_scratch *scratch, int width,
+                                       int size) {
+  size_t row = (size_t)width;
+  scratch->head[0] = scratch->ring + (size + 1) * row;
+  scratch->head[1] = scratch->head[0] + size * row;
+  scratch->tail[0] = scratch->head[1] + size * row;
+  scratch->tail[1] = scratch->tail[0] + size * row;
+}
+
+static inline int blur_scratch_alloc(blur_scratch *scratch, int width,
+                                     int size) {
+  size_t row = (size_t)width;
+  pixel *rows = (pixel *)malloc((5 * size + 1) * row * sizeof(pixel));
+  scratch->lines = (const pixel **)malloc((2 * size + 1) * sizeof(pixel *));
+  if (!rows || !scratch->lines) {
+    free(rows);
+    free(scratch->lines);
+    return 0;
+  }
+
+  scratch->ring = rows;
+  blur_scratch_layout(scratch, width, size);
+  return 1;
+}
+
+static inline void blur_scratch_free(blur_scratch *scratch) {
+  free(scratch->ring);
+  free(scratch->lines);
+}
+
+// Contiguous share of rows [begin, end) of part `part` out of n_parts. Parts
+// are either the threads of a team or tasks of a taskloop.
+static inline void share_rows(int begin, int end, int part, int n_parts,
+                              int *first, int *last) {
+  long n = end - begin;
+  *first = begin + (int)(n * part / n_parts);
+  *last = begin + (int)(n * (part + 1) / n_parts);
+}
+
+// Share of rows [begin, end) of the calling OpenMP thread
+static inline void thread_share_rows(int begin, int end, int *first,
+                                     int *last) {
+  share_rows(begin, end, omp_get_thread_num(), omp_get_num_threads(), first,
+             last);
+}
+
+// Rows of region (counted from its first row) that a blur iteration updates:
+// the rows of the frame's bands that belong to the region, plus `reach` halo
+// rows past each inner edge.
+static inline blur_bands blur_region_bands(const Region *region, int size,
+                                           int reach) {
+  blur_bands bands = blur_band_rows(region->frame_height, size);
+  int y0 = region_has_top(region) ? region->ghost_width - reach : 0;
+  int y1 = region_has_bottom(region)
+               ? region->region_height - region->ghost_width + reach
+               : region->region_height;
+  int *begin[2] = {&bands.top_begin, &bands.bottom_begin};
+  int *end[2] = {&bands.top_end, &bands.bottom_end};
+
+  for (int b = 0; b < 2; b++) {
+    *begin[b] -= region->y_offset;
+    *end[b] -= region->y_offset;
+    if (*begin[b] < y0)
+      *begin[b] = y0;
+    if (*end[b] > y1)
+      *end[b] = y1;
+    if (*end[b] < *begin[b])
+      *end[b] = *begin[b];
+  }
+  return bands;
+}
+
+// A blur iteration works in place on the bands of p, shared out between
+// n_parts parts: blur_save_edges saves the rows around a part's share, then
+// blur_part_rows blurs it, up to `reach` cells past inner edges.
+
+static inline void blur_save_edges(const Region *region, const pixel *p,
+                                   int size, int reach, blur_scratch *scratch,
+                                   int part, int n_parts) {
+  int width = region->region_width;
+  int stride = region->stride;
+  blur_bands bands = blur_region_bands(region, size, reach);
+  int begin[2] = {bands.top_begin, bands.bottom_begin};
+  int end[2] = {bands.top_end, bands.bottom_end};
+
+  for (int b = 0; b < 2; b++) {
+    int first, last;
+    share_rows(begin[b], end[b], part, n_parts, &first, &last);
+    if (first < last) {
+      copy_rows(scratch->head[b], width, &p[CONV(first - size, 0, stride)],
+                stride, width, size);
+      copy_rows(scratch->tail[b], width, &p[CONV(last, 0, stride)], stride,
+                width, size);
+    }
+  }
+}
+
+// The convergence test is done while the new values are produced. Returns
+// whether every pixel of the part stayed within threshold.
+static inline int blur_part_rows(const Region *region, pixel *p,
+                                 blur_row_fn row_kernel, int size,
+                                 int threshold, int reach,
+                                 blur_scratch *scratch, int part,
+                                 int n_parts) {
+  int width = region->region_width;
+  int stride = region->stride;
+  size_t row_bytes = (size_t)width * sizeof(pixel);
+
+  int x0 = region_has_left(region) ? region->ghost_width - reach : 1;
+  int x1 = region_has_right(region) ? width - region->ghost_width + reach
+                                    : width - 1;
+
+  int blur_x0 = (x0 > size) ? x0 : size;
+  int blur_x1 = (x1 < width - size) ? x1 : (width - size);
+
+  blur_bands bands = blur_region_bands(region, size, reach);
+  int first[2], last[2];
+  share_rows(bands.top_begin, bands.top_end, part, n_parts, &first[0],
+             &last[0]);
+  share_rows(bands.bottom_begin, bands.bottom_end, part, n_parts, &first[1],
+             &last[1]);
+
+  int local_end = 1;
+  for (int b = 0; b < 2; b++) {
+    for (int j = first[b]; j < last[b]; j++) {
+      pixel *own = &p[CONV(j, 0, stride)];
+      pixel *old = &scratch->ring[(size_t)(j % (size + 1)) * width];
+      memcpy(old, own, row_bytes);
+
+      for (int s = -size; s <= size; s++) {
+        int i = j + s;
+        const pixel *line;
+        if (i < first[b]) {
+          line = &scratch->head[b][(size_t)(i - first[b] + size) * width];
+        } else if (i <= j) {
+          line = &scratch->ring[(size_t)(i % (size + 1)) * width];
+        } else if (i < last[b]) {
+          line = &p[CONV(i, 0, stride)];
+        } else {
+          line = &scratch->tail[b][(size_t)(i - last[b]) * width];
+        }
+        scratch->lines[s + size] = line;
+      }
+
+      if (blur_x0 < blur_x1) {
+        local_end &= row_kernel(scratch->lines, old, own, blur_x0, blur_x1,
+                                size, threshold);
+      }
+    }
+  }
+
+  return local_end;
+}
+
+// Perform one blur iteration with the threads of the enclosing parallel
+// region as parts. Must be called by every thread, each with its own
+// scratch. Contains one barrier between the two phases; the caller must add
+// another one before p is read again. Returns whether every pixel computed
+// by the calling thread stayed within threshold.
+static inline int blur_iteration(const Region *region, pixel *p,
+                                 blur_row_fn row_kernel, int size,
+                                 int threshold, int reach,
+                                 blur_scratch *scratch) {
+  int part = omp_get_thread_num();
+  int n_parts = omp_get_num_threads();
+
+  blur_save_edges(region, p, size, reach, scratch, part, n_parts);
+  #pragma omp barrier
+  return blur_part_rows(region, p, row_kernel, size, threshold, reach,
+                        scratch, part, n_parts);
+}
+
+// Passes of an out-of-place blur iteration (see blur_copy_bands): the cells
+// within ghost_width of an inner edge, which the neighbours receive, or the
+// others. Both give exactly the values of blur_iteration.
+typedef enum { BLUR_PASS_BOUNDARY, BLUR_PASS_INTERIOR } blur_pass;
+
+// Pixels needed by blur_copy_bands
+static inline size_t blur_copy_size(const Region *region, int size) {
+  blur_bands bands = blur_region_bands(region, size, 0);
+  int begin[2] = {bands.top_begin, bands.bottom_begin};
+  int end[2] = {bands.top_end, bands.bottom_end};
+  size_t rows = 0;
+  for (int b = 0; b < 2; b++) {
+    if (begin[b] < end[b])
+      rows += end[b] - begin[b] + 2 * size;
+  }
+  return rows * region->region_width;
+}
+
+// Copy this part's share of the band rows, and of the size rows around each
+// band, into copy. Every part must be done before any part blurs.
+static inline void blur_copy_bands(const Region *region, const pixel *p,
+                                   int size, pixel *copy, int part,
+                                   int n_parts) {
+  int width = region->region_width;
+  blur_bands bands = blur_region_bands(region, size, 0);
+  int begin[2] = {bands.top_begin, bands.bottom_begin};
+  int end[2] = {bands.top_end, bands.bottom_end};
+
+  for (int b = 0; b < 2; b++) {
+    if (begin[b] >= end[b]) {
+      continue;
+    }
+    int first, last;
+    share_rows(begin[b] - size, end[b] + size, part, n_parts, &first, &last);
+    copy_rows(&copy[(size_t)(first - begin[b] + size) * width], width,
+              &p[CONV(first, 0, region->stride)], region->stride, width,
+              last - first);
+    copy += (size_t)(end[b] - begin[b] + 2 * size) * width;
+  }
+}
+
+// Blur this part's share of the band rows from copy into p, restricted to the
+// cells of pass. Returns whether every pixel stayed within threshold.
+static inline int blur_part_rows_from_copy(const Region *region, pixel *p,
+                                           blur_row_fn row_kernel, int size,
+                                           int threshold, const pixel *copy,
+                                           blur_pass pass,
+                                           blur_scratch *scratch, int part,
+                                           int n_parts) {
+  int width = region->region_width;
+  int ghost = region->ghost_width;
+  int x0 = region_has_left(region) ? ghost : 1;
+  int x1 = region_has_right(region) ? width - ghost : width - 1;
+  int blur_x0 = (x0 > size) ? x0 : size;
+  int blur_x1 = (x1 < width - size) ? x1 : (width - size);
+  if (blur_x0 >= blur_x1) {
+    return 1;
+  }
+
+  // Columns [blur_x0, inner_x0) and [inner_x1, blur_x1) are sent to the
+  // left and right neighbours
+  int inner_x0 = blur_x0, inner_x1 = blur_x1;
+  if (region_has_left(region)) {
+    inner_x0 = x0 + ghost < blur_x1 ? x0 + ghost : blur_x1;
+  }
+  if (region_has_right(region)) {
+    inner_x1 = x1 - ghost > inner_x0 ? x1 - ghost : inner_x0;
+  }
+  // And rows before inner_y0 or from inner_y1 on to the top and bottom ones
+  int inner_y0 = region_has_top(region) ? 2 * ghost : 0;
+  int inner_y1 = region_has_bottom(region)
+                     ? region->region_height - 2 * ghost
+                     : region->region_height;
+
+  blur_bands bands = blur_region_bands(region, size, 0);
+  int begin[2] = {bands.top_begin, bands.bottom_begin};
+  int end[2] = {bands.top_end, bands.bottom_end};
+
+  int local_end = 1;
+  for (int b = 0; b < 2; b++) {
+    if (begin[b] >= end[b]) {
+      continue;
+    }
+    int first, last;
+    share_rows(begin[b], end[b], part, n_parts, &first, &last);
+
+    for (int j = first; j < last; j++) {
+      const pixel *row = &copy[(size_t)(j - begin[b] + size) * width];
+      for (int s = -size; s <= size; s++) {
+        scratch->lines[s + size] = row + (ptrdiff_t)s * width;
+      }
+      pixel *own = &p[CONV(j, 0, region->stride)];
+
+      int edge_row = j < inner_y0 || j >= inner_y1;
+      if (pass == BLUR_PASS_BOUNDARY) {
+        if (edge_row) {
+          local_end &= row_kernel(scratch->lines, row, own, blur_x0, blur_x1,
+                                  size, threshold);
+          continue;
+        }
+        if (blur_x0 < inner_x0) {
+          local_end &= row_kernel(scratch->lines, row, own, blur_x0, inner_x0,
+                                  size, threshold);
+        }
+        if (inner_x1 < blur_x1) {
+          local_end &= row_kernel(scratch->lines, row, own, inner_x1, blur_x1,
+                                  size, threshold);
+        }
+      } else if (!edge_row && inner_x0 < inner_x1) {
+        local_end &= row_kernel(scratch->lines, row, own, inner_x0, inner_x1,
+                                size, threshold);
+      }
+    }
+    copy += (size_t)(end[b] - begin[b] + 2 * size) * width;
+  }
+
+  return local_end;
+}
+
+#endif // BLUR_KERNELS_H
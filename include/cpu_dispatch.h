@@ -0,0 +1,90 @@
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+
+// Runtime selection between several builds of the hot kernels. Each kernel is
+// written once as an always-inline body and compiled once per instruction set
+// (KERNEL_DEFINE_VARIANTS), so the compiler can vectorize it for that target;
+// the variant actually run is chosen from the active ISA, which defaults to
+// the best one the CPU supports and can be overridden with --kernel.
+//
+// None of the variants enables FMA: contracting a*b+c would change the
+// rounding of the sobel gradient, and every variant must produce exactly the
+// same output as the generic one.
+
+typedef enum {
+  KERNEL_ISA_GENERIC,
+  KERNEL_ISA_AVX2,
+  KERNEL_ISA_AVX512,
+  KERNEL_ISA_COUNT
+} kernel_isa_t;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNEL_ISA_X86 1
+#define KERNEL_TARGET_AVX2 __attribute__((target("avx2")))
+#define KERNEL_TARGET_AVX512                                                   \
+  __attribute__((target("avx512f,avx512bw,avx512vl,avx2")))
+#else
+#define KERNEL_ISA_X86 0
+#define KERNEL_TARGET_AVX2
+#define KERNEL_TARGET_AVX512
+#endif
+
+#if defined(__GNUC__)
+#define KERNEL_ALWAYS_INLINE __attribute__((always_inline))
+#else
+#define KERNEL_ALWAYS_INLINE
+#endif
+
+// Best instruction set supported by the running CPU
+kernel_isa_t kernel_isa_best(void);
+
+// Whether the running CPU can execute variants built for isa
+int kernel_isa_supported(kernel_isa_t isa);
+
+// Instruction set whose variants are currently run (detected on first use)
+kernel_isa_t kernel_isa(void);
+
+// Force the variants of isa. Returns 0 if the CPU does not support it.
+int kernel_isa_select(kernel_isa_t isa);
+
+const char *kernel_isa_name(kernel_isa_t isa);
+
+// Parse "generic", "avx2" or "avx512"; "auto" gives kernel_isa_best().
+// Returns 0 if the name is unknown.
+int kernel_isa_parse(const char *name, kernel_isa_t *isa);
+
+// Define NAME_generic, NAME_avx2 and NAME_avx512 around NAME_body, plus
+// NAME_select() returning the variant for the active instruction set. PARAMS
+// and ARGS are the parenthesized parameter and argument lists.
+#define KERNEL_DEFINE_VARIANTS(RET, NAME, PARAMS, ARGS)                        \
+  typedef RET(*NAME##_fn) PARAMS;                                              \
+  static inline RET NAME##_generic PARAMS { return NAME##_body ARGS; }         \
+  KERNEL_TARGET_AVX2 static inline RET NAME##_avx2 PARAMS {                    \
+    return NAME##_body ARGS;                                                   \
+  }                                                                            \
+  KERNEL_TARGET_AVX512 static inline RET NAME##_avx512 PARAMS {                \
+    return NAME##_body ARGS;                                                   \
+  }                                                                            \
+  static inline NAME##_fn NAME##_select(void) {                                \
+    static const NAME##_fn variants[KERNEL_ISA_COUNT] = {                      \
+        NAME##_generic, NAME##_avx2, NAME##_avx512};                           \
+    return variants[kernel_isa()];                                             \
+  }
+
+// Same for kernels that return nothing
+#define KERNEL_DEFINE_VOID_VARIANTS(NAME, PARAMS, ARGS)                        \
+  typedef void (*NAME##_fn) PARAMS;                                            \
+  static inline void NAME##_generic PARAMS { NAME##_body ARGS; }               \
+  KERNEL_TARGET_AVX2 static inline void NAME##_avx2 PARAMS {                   \
+    NAME##_body ARGS;                                                          \
+  }                                                                            \
+  KERNEL_TARGET_AVX512 static inline void NAME##_avx512 PARAMS {               \
+    NAME##_body ARGS;                                                          \
+  }                                                                            \
+  static inline NAME##_fn NAME##_select(void) {                                \
+    static const NAME##_fn variants[KERNEL_ISA_COUNT] = {                      \
+        NAME##_generic, NAME##_avx2, NAME##_avx512};                           \
+    return variants[kernel_isa()];                                             \
+  }
+
+#endif // CPU_DISPATCH_H
@@ -0,0 +1,232 @@
+#ifndef FILTER_CHAIN_H
+#define FILTER_CHAIN_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Filter pipeline applied to every frame. A chain is written as a list of
+// stages separated by commas, semicolons or whitespace, e.g.
+//
+//   gray,blur:5:20,sobel:50
+//
+// Stages:
+//   gray                        grayscale conversion
+//   blur[:radius[:threshold]]   iterative blur of the top/bottom 10% bands,
+//                               repeated until no pixel moves by more than
+//                               threshold (threshold 0 means one iteration)
+//   sobel[:threshold]           edge detection, white where the gradient
+//                               magnitude is above threshold
+//
+// In chain files, '#' starts a comment that runs to the end of the line.
+
+#define FILTER_CHAIN_MAX_STAGES 16
+#define FILTER_CHAIN_DEFAULT "gray,blur:5:20,sobel:50"
+
+#define BLUR_DEFAULT_RADIUS 5
+#define BLUR_DEFAULT_THRESHOLD 20
+#define BLUR_MAX_RADIUS 64
+#define SOBEL_DEFAULT_THRESHOLD 50
+
+typedef enum {
+  FILTER_STAGE_GRAY,
+  FILTER_STAGE_BLUR,
+  FILTER_STAGE_SOBEL
+} filter_stage_kind_t;
+
+typedef struct {
+  filter_stage_kind_t kind;
+  int radius;    // blur only
+  int threshold; // blur: convergence threshold, sobel: edge threshold
+} filter_stage_t;
+
+typedef struct {
+  int n_stages;
+  filter_stage_t stages[FILTER_CHAIN_MAX_STAGES];
+} filter_chain_t;
+
+// Parse an integer parameter that must be in [min, max]
+static inline int filter_chain_parse_int(const char *text, int min, int max,
+                                         int *value) {
+  char *end;
+  errno = 0;
+  long v = strtol(text, &end, 10);
+  if (errno != 0 || end == text || *end != '\0' || v < min || v > max) {
+    return 0;
+  }
+  *value = (int)v;
+  return 1;
+}
+
+// Parse one stage token such as "blur:3:10" (modified in place)
+static inline int filter_chain_parse_stage(char *token, filter_stage_t *stage) {
+  char *params[3] = {token, NULL, NULL};
+  int n_params = 1;
+  for (char *c = token; *c; c++) {
+    if (*c == ':') {
+      if (n_params == 3) {
+        return 0;
+      }
+      *c = '\0';
+      params[n_params++] = c + 1;
+    }
+  }
+
+  if (strcmp(params[0], "gray") == 0 || strcmp(params[0], "grey") == 0) {
+    stage->kind = FILTER_STAGE_GRAY;
+    stage->radius = 0;
+    stage->threshold = 0;
+    return n_params == 1;
+  }
+
+  if (strcmp(params[0], "blur") == 0) {
+    stage->kind = FILTER_STAGE_BLUR;
+    stage->radius = BLUR_DEFAULT_RADIUS;
+    stage->threshold = BLUR_DEFAULT_THRESHOLD;
+    if (n_params > 1 && !filter_chain_parse_int(params[1], 0, BLUR_MAX_RADIUS,
+                                                &stage->radius)) {
+      return 0;
+    }
+    if (n_params > 2 &&
+        !filter_chain_parse_int(params[2], 0, 255, &stage->threshold)) {
+      return 0;
+    }
+    return 1;
+  }
+
+  if (strcmp(params[0], "sobel") == 0) {
+    stage->kind = FILTER_STAGE_SOBEL;
+    stage->radius = 1;
+    stage->threshold = SOBEL_DEFAULT_THRESHOLD;
+    if (n_params > 2) {
+      return 0;
+    }
+    if (n_params > 1 &&
+        !filter_chain_parse_int(params[1], 0, 1024, &stage->threshold)) {
+      return 0;
+    }
+    return 1;
+  }
+
+  return 0;
+}
+
+// Parse a chain description. Returns 1 on success, 0 (with a message on
+// stderr) if the description is malformed.
+static inline int filter_chain_parse(const char *spec, filter_chain_t *chain) {
+  char *copy = strdup(spec);
+  if (!copy) {
+    return 0;
+  }
+
+  // Drop comments so that file contents can be parsed directly
+  for (char *c = copy; *c; c++) {
+    if (*c == '#') {
+      while (*c && *c != '\n') {
+        *c++ = ' ';
+      }
+      if (!*c) {
+        break;
+      }
+    }
+  }
+
+  chain->n_stages = 0;
+  int ok = 1;
+  char *saveptr = NULL;
+  for (char *token = strtok_r(copy, ",; \t\r\n", &saveptr); token;
+       token = strtok_r(NULL, ",; \t\r\n", &saveptr)) {
+    if (chain->n_stages == FILTER_CHAIN_MAX_STAGES) {
+      fprintf(stderr, "Filter chain: more than %d stages\n",
+              FILTER_CHAIN_MAX_STAGES);
+      ok = 0;
+      break;
+    }
+    char stage_text[64];
+    snprintf(stage_text, sizeof(stage_text), "%s", token);
+    if (!filter_chain_parse_stage(token,
+                                  &chain->stages[chain->n_stages++])) {
+      fprintf(stderr, "Filter chain: invalid stage '%s'\n", stage_text);
+      ok = 0;
+      break;
+    }
+  }
+
+  if (ok && chain->n_stages == 0) {
+    fprintf(stderr, "Filter chain: no stage given\n");
+    ok = 0;
+  }
+
+  free(copy);
+  return ok;
+}
+
+// Read and parse a chain description from a file
+static inline int filter_chain_load(const char *path, filter_chain_t *chain) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "Filter chain: unable to open %s\n", path);
+    return 0;
+  }
+
+  char spec[4096];
+  size_t len = fread(spec, 1, sizeof(spec) - 1, f);
+  int truncated = !feof(f);
+  fclose(f);
+  if (truncated) {
+    fprintf(stderr, "Filter chain: %s is too large\n", path);
+    return 0;
+  }
+  spec[len] = '\0';
+
+  return filter_chain_parse(spec, chain);
+}
+
+// Rewrite the chain into an equivalent one that is cheaper to run: gray is
+// idempotent, so repeated gray stages collapse into one, and a blur of radius
+// 0 leaves every pixel unchanged.
+static inline void filter_chain_plan(filter_chain_t *chain) {
+  int n = 0;
+  for (int s = 0; s < chain->n_stages; s++) {
+    filter_stage_t stage = chain->stages[s];
+    if (stage.kind == FILTER_STAGE_BLUR && stage.radius == 0) {
+      continue;
+    }
+    if (stage.kind == FILTER_STAGE_GRAY && n > 0 &&
+        chain->stages[n - 1].kind == FILTER_STAGE_GRAY) {
+      continue;
+    }
+    chain->stages[n++] = stage;
+  }
+  chain->n_stages = n;
+}
+
+// Human-readable form of the chain, in the syntax accepted by the parser
+static inline void filter_chain_format(const filter_chain_t *chain, char *buf,
+                                       size_t len) {
+  size_t pos = 0;
+  buf[0] = '\0';
+  for (int s = 0; s < chain->n_stages && pos < len; s++) {
+    const filter_stage_t *stage = &chain->stages[s];
+    const char *sep = s ? "," : "";
+    switch (stage->kind) {
+    case FILTER_STAGE_GRAY:
+      pos += snprintf(buf + pos, len - pos, "%sgray", sep);
+      break;
+    case FILTER_STAGE_BLUR:
+      pos += snprintf(buf + pos, len - pos, "%sblur:%d:%d", sep, stage->radius,
+                      stage->threshold);
+      break;
+    case FILTER_STAGE_SOBEL:
+      pos += snprintf(buf + pos, len - pos, "%ssobel:%d", sep,
+                      stage->threshold);
+      break;
+    }
+  }
+  if (chain->n_stages == 0) {
+    snprintf(buf, len, "(none)");
+  }
+}
+
+#endif // FILTER_CHAIN_H
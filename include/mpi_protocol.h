@@ -0,0 +1,57 @@
+#ifndef MPI_PROTOCOL_H
+#define MPI_PROTOCOL_H
+
+#include "region_filter.h"
+#include "runtime_config.h"
+#include "shared_frames.h"
+#include "sobel_cuda.h"
+#include "split.h"
+#include <mpi.h>
+
+// Master/worker protocol, shared by both sides: the tags of the messages
+// (see region_message.h for their layout) and the steps both sides run in
+// lockstep.
+
+// Master -> Workers: the command is the tag of the message
+#define CMD_PROCESS_SPLIT_IMAGE 1
+#define CMD_PROCESS_CHUNK 2
+#define CMD_TERMINATE 3
+#define CMD_CALIBRATE 4
+#define CMD_SHARE_FRAMES 5
+#define CMD_SCATTER_SPLIT_IMAGE 6
+
+// Workers -> Master
+#define TAG_RESULT 7
+
+// Window the blocks of split images are received into, kept for the run
+static inline region_window *split_window(void) {
+  static region_window window;
+  return &window;
+}
+
+// This rank's slot of the split window for a block message of size bytes, or
+// NULL if blocks stay in private memory (--shm off, or ranks on several
+// nodes). Collective over world, once per split image.
+static inline char *split_block_slot(int size, runtime_config_t config) {
+  if (config.shm_mode != SHM_MODE_AUTO) {
+    return NULL;
+  }
+  return region_window_reserve(split_window(), size, MPI_COMM_WORLD);
+}
+
+// Filter this rank's block of a split image along with the other ranks
+static inline void filter_split_region(Region *region, int use_gpu,
+                                       runtime_config_t config) {
+  // Halos are copied from the neighbours' slots if the block is in one
+  MPI_Comm grid = region_grid_comm(region, MPI_COMM_WORLD);
+  region_window *window = split_window();
+  int windowed = config.shm_mode == SHM_MODE_AUTO && window->state > 0 &&
+                 region_window_attach(window, region, grid);
+  apply_filter_chain_to_region_mpi_gpu(region, grid, use_gpu, config);
+  if (windowed) {
+    region_window_detach(grid);
+  }
+  MPI_Comm_free(&grid);
+}
+
+#endif // MPI_PROTOCOL_H
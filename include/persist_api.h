@@ -3,4 +3,14 @@
 #include "gif_model.h"
 animated_gif *load_pixels(char *filename);
 int store_pixels(char *filename, animated_gif *image);
+
+/* store_pixels in steps, so that frames can be prepared for output while
+ * later ones are still being filtered: store_begin, then store_frame once
+ * per frame in order (frame i only needs frames 0..i to be final), then
+ * store_end to write the file, or store_abort to give up. */
+typedef struct gif_store gif_store;
+gif_store *store_begin(animated_gif *image);
+int store_frame(gif_store *store, animated_gif *image);
+int store_end(gif_store *store, char *filename, animated_gif *image);
+void store_abort(gif_store *store);
 #endif
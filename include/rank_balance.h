@@ -0,0 +1,76 @@
+#ifndef RANK_BALANCE_H
+#define RANK_BALANCE_H
+
+#include "gif_model.h"
+#include "region_filter.h"
+#include "runtime_config.h"
+#include "split.h"
+#include <mpi.h>
+#include <stdlib.h>
+
+// Throughput-weighted partitioning across ranks. Ranks do not necessarily run
+// at the same speed (different CPUs or thread counts, other jobs sharing a
+// node), and with equal shares the slowest one sets the makespan. Each rank's
+// throughput, in pixels per second through the filter chain, is measured once
+// on a synthetic frame, then refined from the time it spends on its frame
+// batches. Split images get blocks sized, and work queue chunks get frames,
+// in proportion to it.
+
+// Run chain on a synthetic BALANCE_CALIBRATION_SIZE square frame the same way
+// frame batches are filtered, and return the throughput in pixels per second
+static inline double balance_calibrate(const filter_chain_t *chain,
+                                       openmp_mode_t openmp_mode) {
+  int size = BALANCE_CALIBRATION_SIZE;
+  pixel *p = (pixel *)malloc((size_t)size * size * sizeof(pixel));
+  if (!p) {
+    abort();
+  }
+
+  // Deterministic texture with edges, so that blur needs a few iterations
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      int v = ((x * x + 3 * y) ^ (x * y >> 3)) & 255;
+      p[CONV(y, x, size)].r = v;
+      p[CONV(y, x, size)].g = (v + 85) & 255;
+      p[CONV(y, x, size)].b = (v * 7) & 255;
+    }
+  }
+
+  Region *frame = Split(p, 0, size, size, 1, 0, NULL);
+  double start = MPI_Wtime();
+  apply_filter_chain_to_regions(frame, 1, chain, openmp_mode);
+  double seconds = MPI_Wtime() - start;
+
+  free(frame);
+  free(p);
+  return (double)size * size / (seconds > 1e-9 ? seconds : 1e-9);
+}
+
+// Fold a new measurement (pixels filtered in seconds) into a rank's speed
+static inline void balance_update_speed(double *speed, long pixels,
+                                        double seconds) {
+  if (pixels <= 0 || seconds <= 0.0) {
+    return;
+  }
+  double measured = pixels / seconds;
+  *speed = *speed > 0.0 ? 0.5 * (*speed + measured) : measured;
+}
+
+// Split weights of n_ranks ranks from their speeds. No rank gets less than
+// 1/BALANCE_MAX_RATIO of the fastest one's share, so that a noisy measurement
+// cannot shrink a block below the halo it has to provide.
+static inline void balance_weights(const double *speed, int n_ranks,
+                                   double *weights) {
+  double fastest = 0.0;
+  for (int w = 0; w < n_ranks; w++) {
+    if (speed[w] > fastest)
+      fastest = speed[w];
+  }
+  for (int w = 0; w < n_ranks; w++) {
+    weights[w] = fastest > 0.0 ? speed[w] : 1.0;
+    if (weights[w] < fastest / BALANCE_MAX_RATIO)
+      weights[w] = fastest / BALANCE_MAX_RATIO;
+  }
+}
+
+#endif // RANK_BALANCE_H
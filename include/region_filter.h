@@ -5,210 +5,573 @@
 #include "gif_model.h"
 #include "split.h"
 #include "runtime_config.h"
+#include "cpu_dispatch.h"
+#include "filter_chain.h"
+#include "blur_kernels.h"
+#include "shared_frames.h"
 #include <math.h>
 #include <mpi.h>
 #include <stdio.h>
 #include <omp.h>
 #include <stdlib.h>
+#include <string.h>
 
-#define GHOST_WIDTH 5
-
-// Apply gray filter to a single region
-static inline void apply_gray_filter_to_region(Region *region, openmp_mode_t openmp_mode) {
-  if (!region || !region->p) {
-    return;
-  }
-
-  int total_pixels = region->region_width * region->region_height;
-
-  #pragma omp parallel for schedule(static) if(openmp_mode != OPENMP_MODE_OFF)
-  for (int j = 0; j < total_pixels; j++) {
-    int moy = (region->p[j].r + region->p[j].g + region->p[j].b) / 3;
+// Grayscale conversion of n_pixels pixels
+static inline KERNEL_ALWAYS_INLINE void gray_kernel_body(pixel *p,
+                                                        int n_pixels) {
+  for (int j = 0; j < n_pixels; j++) {
+    int moy = (p[j].r + p[j].g + p[j].b) / 3;
     if (moy < 0)
       moy = 0;
     if (moy > 255)
       moy = 255;
 
-    region->p[j].r = moy;
-    region->p[j].g = moy;
-    region->p[j].b = moy;
+    p[j].r = moy;
+    p[j].g = moy;
+    p[j].b = moy;
   }
 }
 
-// Perform one blur iteration
-static inline int blur_iteration(Region *region, pixel *new_pixels, int size,
-                                 int threshold, openmp_mode_t openmp_mode) {
+KERNEL_DEFINE_VOID_VARIANTS(gray_kernel, (pixel *p, int n_pixels),
+                            (p, n_pixels))
+
+// Gray share `part` out of n_parts of a region: a range of pixels when its
+// rows are packed, a range of rows otherwise
+static inline void gray_region_part(Region *region, gray_kernel_fn gray,
+                                    int part, int n_parts) {
   int width = region->region_width;
   int height = region->region_height;
-  pixel *p = region->p;
-  const int denom = (2 * size + 1) * (2 * size + 1);
+  int first, last;
 
-  #pragma omp parallel for collapse(2) schedule(static) if(openmp_mode != OPENMP_MODE_OFF)
-  for (int j = 0; j < height; j++) {
-    for (int k = 0; k < width; k++) {
-      new_pixels[CONV(j, k, width)] = p[CONV(j, k, width)];
-    }
+  if (region_is_contiguous(region)) {
+    share_rows(0, width * height, part, n_parts, &first, &last);
+    gray(region->p + first, last - first);
+    return;
   }
 
-  int x0 = region->region_id == 0? 1 : GHOST_WIDTH;
-  int x1 = region->region_id == region->k_regions - 1? width - 1 : width - GHOST_WIDTH;
+  share_rows(0, height, part, n_parts, &first, &last);
+  for (int j = first; j < last; j++) {
+    gray(&region->p[CONV(j, 0, region->stride)], width);
+  }
+}
 
-  int blur_x0 = (x0 > size) ? x0 : size;
-  int blur_x1 = (x1 < width - size) ? x1 : (width - size);
+// Apply gray filter to a single region
+static inline void apply_gray_filter_to_region(Region *region, openmp_mode_t openmp_mode) {
+  if (!region || !region->p) {
+    return;
+  }
 
-  #pragma omp parallel for collapse(2) schedule(static) if(openmp_mode != OPENMP_MODE_OFF)
-  for (int j = size; j < height / 10 - size; j++) {
-    for (int k = blur_x0; k < blur_x1; k++) {
-      int t_r = 0, t_g = 0, t_b = 0;
+  gray_kernel_fn gray = gray_kernel_select();
 
-      for (int stencil_j = -size; stencil_j <= size; stencil_j++) {
-        for (int stencil_k = -size; stencil_k <= size; stencil_k++) {
-          pixel q = p[CONV(j + stencil_j, k + stencil_k, width)];
-          t_r += q.r;
-          t_g += q.g;
-          t_b += q.b;
-        }
-      }
+  #pragma omp parallel if(openmp_mode != OPENMP_MODE_OFF)
+  gray_region_part(region, gray, omp_get_thread_num(), omp_get_num_threads());
+}
 
-      int idx = CONV(j, k, width);
-      new_pixels[idx].r = (unsigned char)(t_r / denom);
-      new_pixels[idx].g = (unsigned char)(t_g / denom);
-      new_pixels[idx].b = (unsigned char)(t_b / denom);
-    }
-  }
+// Halo width used to split an image into blocks whose smallest split
+// dimension is `extent` pixels, at least size (see filter_chain_min_block):
+// deep enough for BLUR_TIME_BLOCK blur iterations between two exchanges, but
+// never wider than a block, so the halo only ever covers pixels that blur
+// really updates.
+static inline int blur_halo_width(int size, int extent) {
+  assert(extent >= size);
+  int block = extent / size;
+  if (block > BLUR_TIME_BLOCK)
+    block = BLUR_TIME_BLOCK;
+  return block * size;
+}
 
-  #pragma omp parallel for collapse(2) schedule(static) if(openmp_mode != OPENMP_MODE_OFF)
-  for (int j = (int)(height * 0.9) + size; j < height - size; j++) {
-    for (int k = blur_x0; k < blur_x1; k++) {
-      int t_r = 0, t_g = 0, t_b = 0;
+// Copy the band rows (all columns) of p into the packed buffer saved
+static inline void blur_save_bands(const pixel *p, int stride, pixel *saved,
+                                   int width, blur_bands bands) {
+  int top_rows = bands.top_end - bands.top_begin;
+  int bottom_rows = bands.bottom_end - bands.bottom_begin;
+  copy_rows(saved, width, &p[CONV(bands.top_begin, 0, stride)], stride, width,
+            top_rows);
+  copy_rows(&saved[top_rows * width], width,
+            &p[CONV(bands.bottom_begin, 0, stride)], stride, width,
+            bottom_rows);
+}
 
-      for (int stencil_j = -size; stencil_j <= size; stencil_j++) {
-        for (int stencil_k = -size; stencil_k <= size; stencil_k++) {
-          pixel q = p[CONV(j + stencil_j, k + stencil_k, width)];
-          t_r += q.r;
-          t_g += q.g;
-          t_b += q.b;
-        }
-      }
+// Inverse of blur_save_bands
+static inline void blur_restore_bands(pixel *p, int stride, const pixel *saved,
+                                      int width, blur_bands bands) {
+  int top_rows = bands.top_end - bands.top_begin;
+  int bottom_rows = bands.bottom_end - bands.bottom_begin;
+  copy_rows(&p[CONV(bands.top_begin, 0, stride)], stride, saved, width, width,
+            top_rows);
+  copy_rows(&p[CONV(bands.bottom_begin, 0, stride)], stride,
+            &saved[top_rows * width], width, width, bottom_rows);
+}
 
-      int idx = CONV(j, k, width);
-      new_pixels[idx].r = (unsigned char)(t_r / denom);
-      new_pixels[idx].g = (unsigned char)(t_g / denom);
-      new_pixels[idx].b = (unsigned char)(t_b / denom);
+// Most row ranges a halo exchange can be restricted to
+#define GHOST_MAX_RANGES 2
+
+// Datatype describing, in place in region->p, the cells of the block
+// [x0, x1) x [y0, y1) whose frame row falls in one of the n_ranges ranges
+// [row_begin[r], row_end[r]): one strided vector of rows per range. Returns
+// the number of rows described; the type is only created (and committed) if
+// there is at least one, and must then be freed with MPI_Type_free.
+static inline int ghost_block_type(const Region *region, int x0, int x1,
+                                   int y0, int y1, int n_ranges,
+                                   const int *row_begin, const int *row_end,
+                                   MPI_Datatype *type) {
+  assert(n_ranges <= GHOST_MAX_RANGES);
+  int blocklens[GHOST_MAX_RANGES];
+  MPI_Aint displs[GHOST_MAX_RANGES];
+  MPI_Datatype rows[GHOST_MAX_RANGES];
+  int n_rows = 0;
+  int n = 0;
+
+  for (int r = 0; r < n_ranges; r++) {
+    int begin = row_begin[r] - region->y_offset;
+    int end = row_end[r] - region->y_offset;
+    begin = begin > y0 ? begin : y0;
+    end = end < y1 ? end : y1;
+    if (end <= begin || x1 <= x0) {
+      continue;
     }
+
+    // Pixels are three ints
+    MPI_Type_create_hvector(end - begin, 3 * (x1 - x0),
+                            (MPI_Aint)region->stride * sizeof(pixel), MPI_INT,
+                            &rows[n]);
+    blocklens[n] = 1;
+    displs[n] = (MPI_Aint)(CONV(begin, x0, region->stride)) * sizeof(pixel);
+    n_rows += end - begin;
+    n++;
   }
 
-  int local_end = 1;
+  if (n == 0) {
+    return 0;
+  }
+  MPI_Type_create_struct(n, blocklens, displs, rows, type);
+  MPI_Type_commit(type);
+  for (int r = 0; r < n; r++) {
+    MPI_Type_free(&rows[r]);
+  }
+  return n_rows;
+}
 
-  #pragma omp parallel for collapse(2) reduction(&&:local_end) schedule(static) if(openmp_mode != OPENMP_MODE_OFF )
-  for (int j = 1; j < height - 1; j++) {
-    for (int k = x0; k < x1; k++) {
-      int idx = CONV(j, k, width);
+// Halo cells copied straight from a neighbour's block in a region window
+typedef struct {
+  pixel *dst;
+  const pixel *src;
+  int dst_stride;
+  int src_stride;
+  int width;
+  int rows;
+} halo_copy;
+
+// Halo exchange of a region with its up to 8 neighbours, set up once and
+// restarted with halo_exchange_start / halo_exchange_wait: persistent requests
+// on in-place datatypes, or copies from their slots if in a region window.
+typedef struct {
+  int n_requests;
+  MPI_Request requests[16];
+  MPI_Datatype types[16];
+  const region_window *window;
+  int n_copies;
+  halo_copy copies[8 * GHOST_MAX_RANGES];
+} halo_exchange;
+
+// Add the copies of the halo cells [x0, x1) x [y0, y1) of region lying in
+// the given frame row ranges from the block of grid rank neighbor
+static inline void halo_exchange_add_copies(halo_exchange *halo,
+                                            Region *region, int neighbor,
+                                            int x0, int x1, int y0, int y1,
+                                            int n_ranges, const int *row_begin,
+                                            const int *row_end) {
+  const int *geometry = &halo->window->geometry[3 * neighbor];
+  for (int r = 0; r < n_ranges; r++) {
+    int begin = row_begin[r] - region->y_offset;
+    int end = row_end[r] - region->y_offset;
+    begin = begin > y0 ? begin : y0;
+    end = end < y1 ? end : y1;
+    if (end <= begin || x1 <= x0) {
+      continue;
+    }
 
-      float diff_r = (float)new_pixels[idx].r - (float)p[idx].r;
-      float diff_g = (float)new_pixels[idx].g - (float)p[idx].g;
-      float diff_b = (float)new_pixels[idx].b - (float)p[idx].b;
+    // Same frame cells, in the neighbour's block
+    int src_x = region->x_offset + x0 - geometry[0];
+    int src_y = region->y_offset + begin - geometry[1];
+    halo_copy *copy = &halo->copies[halo->n_copies++];
+    copy->dst = &region->p[CONV(begin, x0, region->stride)];
+    copy->src = &halo->window->base[neighbor][CONV(src_y, src_x, geometry[2])];
+    copy->dst_stride = region->stride;
+    copy->src_stride = geometry[2];
+    copy->width = x1 - x0;
+    copy->rows = end - begin;
+  }
+}
 
-      int ok =
-          !(diff_r > threshold || -diff_r > threshold || diff_g > threshold ||
-            -diff_g > threshold || diff_b > threshold || -diff_b > threshold);
+// Set up the exchange of the halo cells lying in frame rows
+// [row_begin[r], row_end[r]), for each of the n_ranges row ranges, with the
+// left/right strips, top/bottom strips and four corners around region. comm
+// is the cartesian communicator of the region grid (see region_grid_comm).
+static inline void halo_exchange_init(halo_exchange *halo, Region *region,
+                                      MPI_Comm comm, int n_ranges,
+                                      const int *row_begin,
+                                      const int *row_end) {
+  halo->n_requests = 0;
+  halo->n_copies = 0;
+  halo->window = NULL;
+  int ghost = region->ghost_width;
+  if (region->k_regions <= 1 || ghost == 0) {
+    return;
+  }
+  halo->window = region_window_of(comm);
+
+  int grid_x = region_grid_x(region);
+  int grid_y = region_grid_y(region);
+
+  // Cells the region owns
+  int own_x0 = region_has_left(region) ? ghost : 0;
+  int own_x1 = region->region_width - (region_has_right(region) ? ghost : 0);
+  int own_y0 = region_has_top(region) ? ghost : 0;
+  int own_y1 = region->region_height - (region_has_bottom(region) ? ghost : 0);
+
+  // Directions are numbered row by row, so the opposite of d is 7 - d
+  int d = 0;
+  for (int dy = -1; dy <= 1; dy++) {
+    for (int dx = -1; dx <= 1; dx++) {
+      if (dx == 0 && dy == 0) {
+        continue;
+      }
+      int dir = d++;
+      if (grid_x + dx < 0 || grid_x + dx >= region->grid_cols ||
+          grid_y + dy < 0 || grid_y + dy >= region->grid_rows) {
+        continue;
+      }
+
+      // Own cells next to the neighbour, and the halo cells facing it
+      int out[4], in[4];
+      out[0] = dx < 0 ? own_x0 : dx > 0 ? own_x1 - ghost : own_x0;
+      out[1] = dx < 0 ? own_x0 + ghost : own_x1;
+      out[2] = dy < 0 ? own_y0 : dy > 0 ? own_y1 - ghost : own_y0;
+      out[3] = dy < 0 ? own_y0 + ghost : own_y1;
+      in[0] = dx < 0 ? own_x0 - ghost : dx > 0 ? own_x1 : own_x0;
+      in[1] = dx < 0 ? own_x0 : dx > 0 ? own_x1 + ghost : own_x1;
+      in[2] = dy < 0 ? own_y0 - ghost : dy > 0 ? own_y1 : own_y0;
+      in[3] = dy < 0 ? own_y0 : dy > 0 ? own_y1 + ghost : own_y1;
+
+      int coords[2] = {grid_y + dy, grid_x + dx};
+      int neighbor;
+      MPI_Cart_rank(comm, coords, &neighbor);
+
+      if (halo->window) {
+        halo_exchange_add_copies(halo, region, neighbor, in[0], in[1], in[2],
+                                 in[3], n_ranges, row_begin, row_end);
+        continue;
+      }
 
-      local_end = local_end && ok;
+      // Both sides describe the same rows, so a neighbour receives exactly
+      // when it sends
+      MPI_Datatype send_type, recv_type;
+      int send_rows = ghost_block_type(region, out[0], out[1], out[2], out[3],
+                                       n_ranges, row_begin, row_end,
+                                       &send_type);
+      int recv_rows = ghost_block_type(region, in[0], in[1], in[2], in[3],
+                                       n_ranges, row_begin, row_end,
+                                       &recv_type);
+      if (send_rows == 0 && recv_rows == 0) {
+        continue;
+      }
+
+      if (send_rows > 0) {
+        halo->types[halo->n_requests] = send_type;
+        MPI_Send_init(region->p, 1, send_type, neighbor, dir, comm,
+                      &halo->requests[halo->n_requests++]);
+      }
+      if (recv_rows > 0) {
+        halo->types[halo->n_requests] = recv_type;
+        MPI_Recv_init(region->p, 1, recv_type, neighbor, 7 - dir, comm,
+                      &halo->requests[halo->n_requests++]);
+      }
     }
   }
+}
 
-  #pragma omp parallel for collapse(2) schedule(static) if(openmp_mode != OPENMP_MODE_OFF)
-  for (int j = 1; j < height - 1; j++) {
-    for (int k = x0; k < x1; k++) {
-      p[CONV(j, k, width)] = new_pixels[CONV(j, k, width)];
+// Start all the sends and receives of the exchange. In a region window, the
+// cells are copied right away, once every rank of the grid has got here.
+static inline void halo_exchange_start(halo_exchange *halo) {
+  if (halo->window) {
+    MPI_Win_sync(halo->window->win);
+    MPI_Barrier(halo->window->node);
+    MPI_Win_sync(halo->window->win);
+    for (int c = 0; c < halo->n_copies; c++) {
+      const halo_copy *copy = &halo->copies[c];
+      copy_rows(copy->dst, copy->dst_stride, copy->src, copy->src_stride,
+                copy->width, copy->rows);
     }
+    return;
+  }
+  if (halo->n_requests > 0) {
+    MPI_Startall(halo->n_requests, halo->requests);
   }
+}
 
-  return local_end;
+// Await exchanges. In a region window, wait until no rank of the grid reads
+// the others' blocks any more.
+static inline void halo_exchange_wait(halo_exchange *halo) {
+  if (halo->window) {
+    MPI_Barrier(halo->window->node);
+    return;
+  }
+  if (halo->n_requests > 0) {
+    MPI_Waitall(halo->n_requests, halo->requests, MPI_STATUSES_IGNORE);
+  }
+}
+
+static inline void halo_exchange_free(halo_exchange *halo) {
+  for (int r = 0; r < halo->n_requests; r++) {
+    MPI_Request_free(&halo->requests[r]);
+    MPI_Type_free(&halo->types[r]);
+  }
+  halo->n_requests = 0;
+}
+
+// Exchange the halo cells lying in the given frame row ranges once (see
+// halo_exchange_init)
+static inline void exchange_ghost_rows(Region *region, MPI_Comm comm,
+                                       int n_ranges, const int *row_begin,
+                                       const int *row_end) {
+  halo_exchange halo;
+  halo_exchange_init(&halo, region, comm, n_ranges, row_begin, row_end);
+  halo_exchange_start(&halo);
+  halo_exchange_wait(&halo);
+  halo_exchange_free(&halo);
 }
 
 // Exchange ghost cells with neighboring workers
 static inline void exchange_ghost_cells(Region *region, MPI_Comm comm, openmp_mode_t openmp_mode) {
-  int region_id = region->region_id;
-  int k_regions = region->k_regions;
-  int width = region->region_width;
-  int height = region->region_height;
-  pixel *p = region->p;
+  int row_begin = 0;
+  int row_end = region->frame_height;
 
-  int ghost_size = GHOST_WIDTH * height;
-
-  pixel *send_left = NULL;
-  pixel *send_right = NULL;
-  pixel *recv_left = NULL;
-  pixel *recv_right = NULL;
+  exchange_ghost_rows(region, comm, 1, &row_begin, &row_end);
+}
 
-  MPI_Request requests[4];
-  int num_requests = 0;
+// Set up the exchange of only the ghost cells of the blur bands. Rows outside
+// the bands never change during blur (the stencil reads up to size rows past
+// them, but those ghost cells are still the ones received before the blur
+// started), so their ghost cells do not need to be sent again.
+static inline void blur_band_halo_init(halo_exchange *halo, Region *region,
+                                       MPI_Comm comm, int size) {
+  blur_bands bands = blur_band_rows(region->frame_height, size);
+  int row_begin[2] = {bands.top_begin, bands.bottom_begin};
+  int row_end[2] = {bands.top_end, bands.bottom_end};
+
+  halo_exchange_init(halo, region, comm, 2, row_begin, row_end);
+}
 
-  // Do we have left and right neighbours?
-  int has_left_neighbor = (region_id > 0);
-  int has_right_neighbor = (region_id < k_regions - 1);
+// Cartesian communicator laid out like the region grid of a split image, in
+// which rank region_id is the block at (grid_y, grid_x). Collective over
+// comm, whose size must be k_regions; free with MPI_Comm_free.
+static inline MPI_Comm region_grid_comm(const Region *region, MPI_Comm comm) {
+  int dims[2] = {region->grid_rows, region->grid_cols};
+  int periods[2] = {0, 0};
+  MPI_Comm grid;
+  MPI_Cart_create(comm, 2, dims, periods, 0, &grid);
+  return grid;
+}
 
-  if (has_left_neighbor) {
-    send_left = (pixel *)malloc(ghost_size * sizeof(pixel));
-    recv_left = (pixel *)malloc(ghost_size * sizeof(pixel));
+// Blur region in place until convergence, in one OpenMP parallel region. On
+// split images, runs up to BLUR_TIME_BLOCK iterations between halo exchanges
+// over comm; the result is exactly the one of the unblocked loop.
+static inline void blur_until_converged(Region *region, int size,
+                                        int threshold, MPI_Comm comm,
+                                        openmp_mode_t openmp_mode) {
+  int k_regions = region->k_regions;
+  int width = region->region_width;
+  pixel *p = region->p;
+  // Every band row of the region, halo included, as a time block may touch
+  // them all
+  blur_bands bands = blur_region_bands(region, size, region->ghost_width);
+
+  // Only split images that iterate until convergence speculate; otherwise
+  // the loop runs single iterations reduced on the spot
+  int pipelined = k_regions > 1 && threshold > 0;
+
+  int block = 1;
+  if (pipelined && size > 0) {
+    block = region->ghost_width / size;
+    if (block > BLUR_TIME_BLOCK)
+      block = BLUR_TIME_BLOCK;
+    if (block < 1)
+      block = 1;
+  }
 
-    for (int y = 0; y < height; y++) {
-      for (int x = 0; x < GHOST_WIDTH; x++) {
-        send_left[y * GHOST_WIDTH + x] = p[CONV(y, GHOST_WIDTH + x, width)];
+  int max_threads = openmp_mode != OPENMP_MODE_OFF ? omp_get_max_threads() : 1;
+  blur_scratch *scratch =
+      (blur_scratch *)malloc(max_threads * sizeof(blur_scratch));
+  if (!scratch) {
+    return;
+  }
+  for (int i = 0; i < max_threads; i++) {
+    if (!blur_scratch_alloc(&scratch[i], width, size)) {
+      while (i-- > 0) {
+        blur_scratch_free(&scratch[i]);
       }
+      free(scratch);
+      return;
     }
-
-    // Async makes it faster!
-    MPI_Isend(send_left, ghost_size * sizeof(pixel), MPI_BYTE, region_id - 1, 0,
-              comm, &requests[num_requests++]);
-    MPI_Irecv(recv_left, ghost_size * sizeof(pixel), MPI_BYTE, region_id - 1, 1,
-              comm, &requests[num_requests++]);
   }
 
-  if (has_right_neighbor) {
-    send_right = (pixel *)malloc(ghost_size * sizeof(pixel));
-    recv_right = (pixel *)malloc(ghost_size * sizeof(pixel));
-
-    for (int y = 0; y < height; y++) {
-      for (int x = 0; x < GHOST_WIDTH; x++) {
-        send_right[y * GHOST_WIDTH + x] =
-            p[CONV(y, width - 2 * GHOST_WIDTH + x, width)];
+  // Band rows at the start of the two blocks in flight
+  pixel *saved[2] = {NULL, NULL};
+  if (pipelined) {
+    size_t band_pixels = (size_t)((bands.top_end - bands.top_begin) +
+                                  (bands.bottom_end - bands.bottom_begin)) *
+                         width;
+    saved[0] = (pixel *)malloc((2 * band_pixels + 1) * sizeof(pixel));
+    if (!saved[0]) {
+      for (int i = 0; i < max_threads; i++) {
+        blur_scratch_free(&scratch[i]);
       }
+      free(scratch);
+      return;
     }
-
-    // Async makes it faster!
-    MPI_Isend(send_right, ghost_size * sizeof(pixel), MPI_BYTE, region_id + 1,
-              1, comm, &requests[num_requests++]);
-    MPI_Irecv(recv_right, ghost_size * sizeof(pixel), MPI_BYTE, region_id + 1,
-              0, comm, &requests[num_requests++]);
+    saved[1] = saved[0] + band_pixels;
   }
 
-  // Await exchanges
-  if (num_requests > 0) {
-    MPI_Waitall(num_requests, requests, MPI_STATUSES_IGNORE);
-  }
-
-  if (has_left_neighbor && recv_left) {
-    for (int y = 0; y < height; y++) {
-      for (int x = 0; x < GHOST_WIDTH; x++) {
-        p[CONV(y, x, width)] = recv_left[y * GHOST_WIDTH + x];
+  blur_row_fn row_kernel = blur_select_row(size);
+
+  // The band exchange repeats identically after every block
+  halo_exchange halo = {0};
+  pixel *copy = NULL;
+  if (k_regions > 1) {
+    // One pixel more, so that regions without band rows get a buffer too
+    copy = (pixel *)malloc((blur_copy_size(region, size) + 1) * sizeof(pixel));
+    if (!copy) {
+      free(saved[0]);
+      for (int i = 0; i < max_threads; i++) {
+        blur_scratch_free(&scratch[i]);
       }
+      free(scratch);
+      return;
     }
-    free(recv_left);
-    free(send_left);
+    blur_band_halo_init(&halo, region, comm, size);
   }
 
-  if (has_right_neighbor && recv_right) {
-    for (int y = 0; y < height; y++) {
-      for (int x = 0; x < GHOST_WIDTH; x++) {
-        p[CONV(y, width - GHOST_WIDTH + x, width)] =
-            recv_right[y * GHOST_WIDTH + x];
+  // Flags of the current block and of the previous one, being reduced
+  int iter_end[2][BLUR_TIME_BLOCK];
+  int global_end[2][BLUR_TIME_BLOCK];
+  MPI_Request reduction = MPI_REQUEST_NULL;
+  int pending = 0;
+  int cur = 0;
+  int converged_at = -1;
+  int replay_to = -1;
+
+  #pragma omp parallel num_threads(max_threads) if(openmp_mode != OPENMP_MODE_OFF)
+  {
+    blur_scratch *own = &scratch[omp_get_thread_num()];
+
+    do {
+      #pragma omp master
+      {
+        for (int t = 0; t < block; t++) {
+          iter_end[cur][t] = 1;
+        }
+        if (saved[cur]) {
+          blur_save_bands(p, region->stride, saved[cur], width, bands);
+        }
       }
-    }
-    free(recv_right);
-    free(send_right);
+      #pragma omp barrier
+
+      for (int t = 0; t < block; t++) {
+        // Iteration t + 1 still reads size more halo columns than it writes
+        int reach = (block - 1 - t) * size;
+        int local_end;
+        if (copy && t == block - 1) {
+          int part = omp_get_thread_num();
+          int n_parts = omp_get_num_threads();
+          blur_copy_bands(region, p, size, copy, part, n_parts);
+          #pragma omp barrier
+          local_end = blur_part_rows_from_copy(region, p, row_kernel, size,
+                                               threshold, copy,
+                                               BLUR_PASS_BOUNDARY, own, part,
+                                               n_parts);
+          #pragma omp barrier
+          // The interior touches none of the exchanged cells: no barrier
+          #pragma omp master
+          halo_exchange_start(&halo);
+          local_end &= blur_part_rows_from_copy(region, p, row_kernel, size,
+                                                threshold, copy,
+                                                BLUR_PASS_INTERIOR, own, part,
+                                                n_parts);
+        } else {
+          local_end = blur_iteration(region, p, row_kernel, size, threshold,
+                                     reach, own);
+        }
+        if (!local_end) {
+          #pragma omp atomic write
+          iter_end[cur][t] = 0;
+        }
+        #pragma omp barrier
+      }
+
+      #pragma omp master
+      {
+        converged_at = -1;
+        replay_to = -1;
+        if (k_regions > 1) {
+          halo_exchange_wait(&halo);
+        }
+
+        if (!pipelined) {
+          // Single iterations, reduced over comm if the image is split
+          if (k_regions > 1) {
+            MPI_Allreduce(iter_end[cur], global_end[cur], 1, MPI_INT,
+                          MPI_LAND, comm);
+          } else {
+            global_end[cur][0] = iter_end[cur][0];
+          }
+          converged_at = global_end[cur][0] ? 0 : -1;
+        } else {
+          if (pending) {
+            // Outcome of the previous block, reduced while this one ran
+            MPI_Wait(&reduction, MPI_STATUS_IGNORE);
+            pending = 0;
+            for (int t = 0; t < block && converged_at < 0; t++) {
+              if (global_end[1 - cur][t]) {
+                converged_at = t;
+              }
+            }
+          }
+
+          if (converged_at == block - 1) {
+            // This block was one too many: back to its start
+            blur_restore_bands(p, region->stride, saved[cur], width, bands);
+          } else if (converged_at >= 0) {
+            blur_restore_bands(p, region->stride, saved[1 - cur], width,
+                               bands);
+            replay_to = converged_at;
+          } else {
+            MPI_Iallreduce(iter_end[cur], global_end[cur], block, MPI_INT,
+                           MPI_LAND, comm, &reduction);
+            pending = 1;
+            cur = 1 - cur;
+          }
+        }
+      }
+      #pragma omp barrier
+
+      // Replay the previous block from its saved start up to the converged
+      // iteration
+      for (int t = 0; t <= replay_to; t++) {
+        blur_iteration(region, p, row_kernel, size, threshold,
+                       (block - 1 - t) * size, own);
+        #pragma omp barrier
+      }
+    } while (threshold > 0 && converged_at < 0);
+  }
+
+  halo_exchange_free(&halo);
+  free(copy);
+  free(saved[0]);
+  for (int i = 0; i < max_threads; i++) {
+    blur_scratch_free(&scratch[i]);
   }
+  free(scratch);
 }
 
 static inline void apply_blur_filter_to_region_mpi(Region *region, int size,
@@ -218,34 +581,7 @@ static inline void apply_blur_filter_to_region_mpi(Region *region, int size,
     return;
   }
 
-  int width = region->region_width;
-  int height = region->region_height;
-  int k_regions = region->k_regions;
-
-  pixel *new_pixels = (pixel *)malloc(width * height * sizeof(pixel));
-  if (!new_pixels) {
-    return;
-  }
-
-  int global_end = 0;
-
-  do {
-    int local_end = blur_iteration(region, new_pixels, size, threshold, openmp_mode);
-
-    // If image is split across multiple workers, sync ghost cells and
-    // convergence
-    if (k_regions > 1) {
-      // Exchange ghost cells with neighbors
-      exchange_ghost_cells(region, comm, openmp_mode);
-
-      MPI_Allreduce(&local_end, &global_end, 1, MPI_INT, MPI_LAND, comm);
-    } else {
-      global_end = local_end;
-    }
-
-  } while (threshold > 0 && !global_end);
-
-  free(new_pixels);
+  blur_until_converged(region, size, threshold, comm, openmp_mode);
 }
 
 static inline void apply_blur_filter_to_region(Region *region, int size,
@@ -254,79 +590,258 @@ static inline void apply_blur_filter_to_region(Region *region, int size,
     return;
   }
 
-  int width = region->region_width;
-  int height = region->region_height;
+  blur_until_converged(region, size, threshold, MPI_COMM_NULL, openmp_mode);
+}
 
-  pixel *new_pixels = (pixel *)malloc(width * height * sizeof(pixel));
-  if (!new_pixels) {
-    return;
+// Width of the row segments sobel tests for flatness
+#define SOBEL_TILE_WIDTH 32
+
+// Sobel on columns [x0, x1) of rows [y0, y1) of p (rows stride pixels apart),
+// in place, shared out between n_parts parts. sobel_save_edges saves the rows
+// around a part's share, then once all parts have, sobel_rows_body filters.
+static inline void sobel_save_edges(const pixel *p, int width, int stride,
+                                    int y0, int y1, pixel *rows, int part,
+                                    int n_parts) {
+  size_t row_bytes = (size_t)width * sizeof(pixel);
+  int first, last;
+  share_rows(y0, y1, part, n_parts, &first, &last);
+  if (first < last) {
+    memcpy(rows, &p[CONV(first - 1, 0, stride)], row_bytes);
+    memcpy(rows + 2 * width, &p[CONV(last, 0, stride)], row_bytes);
   }
+}
 
-  int end = 0;
+// Filter a part's rows. Segments whose input window has
+// 2 * (max - min)^2 <= threshold^2 can only produce zeros and are filled
+// without evaluating the stencil.
+static inline KERNEL_ALWAYS_INLINE void
+sobel_rows_body(pixel *p, int width, int stride, int y0, int y1, int x0,
+                int x1, int threshold, pixel *rows, int part, int n_parts) {
+  size_t row_bytes = (size_t)width * sizeof(pixel);
+  pixel *above = rows;
+  pixel *center = rows + width;
+  const pixel *after = rows + 2 * width;
+
+  int first, last;
+  share_rows(y0, y1, part, n_parts, &first, &last);
+
+  for (int j = first; j < last; j++) {
+    pixel *out = &p[CONV(j, 0, stride)];
+    memcpy(center, out, row_bytes);
+    const pixel *below = (j + 1 < last) ? &p[CONV(j + 1, 0, stride)] : after;
+
+    for (int k0 = x0; k0 < x1; k0 += SOBEL_TILE_WIDTH) {
+      int k1 = (k0 + SOBEL_TILE_WIDTH < x1) ? k0 + SOBEL_TILE_WIDTH : x1;
+
+      int lo = 255, hi = 0;
+      for (int k = k0 - 1; k <= k1; k++) {
+        int b_min = above[k].b, b_max = above[k].b;
+        b_min = center[k].b < b_min ? center[k].b : b_min;
+        b_max = center[k].b > b_max ? center[k].b : b_max;
+        b_min = below[k].b < b_min ? below[k].b : b_min;
+        b_max = below[k].b > b_max ? below[k].b : b_max;
+        lo = b_min < lo ? b_min : lo;
+        hi = b_max > hi ? b_max : hi;
+      }
 
-  do {
-    end = blur_iteration(region, new_pixels, size, threshold, openmp_mode);
-  } while (threshold > 0 && !end);
+      if (2 * (hi - lo) * (hi - lo) <= threshold * threshold) {
+        memset(&out[k0], 0, (k1 - k0) * sizeof(pixel));
+        continue;
+      }
 
-  free(new_pixels);
+      for (int k = k0; k < k1; k++) {
+        int pixel_blue_no = above[k - 1].b;
+        int pixel_blue_n = above[k].b;
+        int pixel_blue_ne = above[k + 1].b;
+        int pixel_blue_so = below[k - 1].b;
+        int pixel_blue_s = below[k].b;
+        int pixel_blue_se = below[k + 1].b;
+        int pixel_blue_o = center[k - 1].b;
+        int pixel_blue_e = center[k + 1].b;
+
+        float deltaX_blue = -pixel_blue_no + pixel_blue_ne -
+                            2.0f * pixel_blue_o + 2.0f * pixel_blue_e -
+                            pixel_blue_so + pixel_blue_se;
+
+        float deltaY_blue = pixel_blue_se + 2.0f * pixel_blue_s +
+                            pixel_blue_so - pixel_blue_ne -
+                            2.0f * pixel_blue_n - pixel_blue_no;
+
+        float val_blue =
+            sqrtf(deltaX_blue * deltaX_blue + deltaY_blue * deltaY_blue) /
+            4.0f;
+
+        out[k] = (val_blue > (float)threshold) ? (pixel){255, 255, 255}
+                                               : (pixel){0, 0, 0};
+      }
+    }
+
+    pixel *tmp = above;
+    above = center;
+    center = tmp;
+  }
 }
 
-static inline void apply_sobel_filter_to_region(Region *region, openmp_mode_t openmp_mode) {
+KERNEL_DEFINE_VOID_VARIANTS(sobel_rows,
+                            (pixel *p, int width, int stride, int y0, int y1,
+                             int x0, int x1, int threshold, pixel *rows,
+                             int part, int n_parts),
+                            (p, width, stride, y0, y1, x0, x1, threshold, rows,
+                             part, n_parts))
+
+// Cells of a region sobel writes: everything but the frame border, which is
+// left untouched, and the halo, which belongs to the neighbours
+static inline void sobel_region_bounds(const Region *region, int *x0, int *x1,
+                                       int *y0, int *y1) {
+  int ghost = region->ghost_width;
+  *x0 = region_has_left(region) ? ghost : 1;
+  *x1 = region->region_width - (region_has_right(region) ? ghost : 1);
+  *y0 = region_has_top(region) ? ghost : 1;
+  *y1 = region->region_height - (region_has_bottom(region) ? ghost : 1);
+}
+
+static inline void apply_sobel_filter_to_region(Region *region, int threshold,
+                                                openmp_mode_t openmp_mode) {
   if (!region || !region->p) {
     return;
   }
 
   int width = region->region_width;
-  int height = region->region_height;
+  int stride = region->stride;
   pixel *p = region->p;
 
-  pixel *sobel = (pixel *)malloc(width * height * sizeof(pixel));
-  if (!sobel) {
-    return;
+  int x0, x1, y0, y1;
+  sobel_region_bounds(region, &x0, &x1, &y0, &y1);
+
+  sobel_rows_fn sobel = sobel_rows_select();
+
+  // Three saved rows per thread of the team actually running
+  pixel *rows = NULL;
+  #pragma omp parallel if(openmp_mode != OPENMP_MODE_OFF)
+  {
+    int part = omp_get_thread_num();
+    int n_parts = omp_get_num_threads();
+    #pragma omp single
+    rows = (pixel *)malloc((size_t)n_parts * 3 * width * sizeof(pixel));
+
+    if (rows) {
+      pixel *own = rows + (size_t)part * 3 * width;
+      sobel_save_edges(p, width, stride, y0, y1, own, part, n_parts);
+      #pragma omp barrier
+      sobel(p, width, stride, y0, y1, x0, x1, threshold, own, part, n_parts);
+    }
   }
 
-#pragma omp parallel for collapse(2) schedule(static)
-  for (int j = 1; j < height - 1; j++) {
-    for (int k = 1; k < width - 1; k++) {
-      int pixel_blue_no = p[CONV(j - 1, k - 1, width)].b;
-      int pixel_blue_n = p[CONV(j - 1, k, width)].b;
-      int pixel_blue_ne = p[CONV(j - 1, k + 1, width)].b;
-      int pixel_blue_so = p[CONV(j + 1, k - 1, width)].b;
-      int pixel_blue_s = p[CONV(j + 1, k, width)].b;
-      int pixel_blue_se = p[CONV(j + 1, k + 1, width)].b;
-      int pixel_blue_o = p[CONV(j, k - 1, width)].b;
-      int pixel_blue_e = p[CONV(j, k + 1, width)].b;
+  free(rows);
+}
 
-      float deltaX_blue = -pixel_blue_no + pixel_blue_ne - 2.0f * pixel_blue_o +
-                          2.0f * pixel_blue_e - pixel_blue_so + pixel_blue_se;
+// Narrowest block, across a cut, on which chain can run split: the halo of
+// a single blur iteration of the widest radius, or the one pixel sobel reads
+static inline int filter_chain_min_block(const filter_chain_t *chain) {
+  int min_block = 1;
+  for (int s = 0; s < chain->n_stages; s++) {
+    const filter_stage_t *stage = &chain->stages[s];
+    if (stage->kind == FILTER_STAGE_BLUR && stage->radius > min_block)
+      min_block = stage->radius;
+  }
+  return min_block;
+}
 
-      float deltaY_blue = pixel_blue_se + 2.0f * pixel_blue_s + pixel_blue_so -
-                          pixel_blue_ne - 2.0f * pixel_blue_n - pixel_blue_no;
+// Whether an image can be split in k_regions blocks to run chain, every
+// block being at least filter_chain_min_block across each cut. Frames that
+// cannot are filtered whole.
+static inline int filter_chain_split_fits(const filter_chain_t *chain,
+                                          int image_width, int image_height,
+                                          int k_regions) {
+  int grid_cols, grid_rows;
+  return split_grid(image_width, image_height, k_regions,
+                    filter_chain_min_block(chain), &grid_cols, &grid_rows);
+}
 
-      float val_blue =
-          sqrtf(deltaX_blue * deltaX_blue + deltaY_blue * deltaY_blue) / 4.0f;
+// Halo width needed to run chain on an image split in k_regions blocks (see
+// split_grid and split_bounds, weights as given to Split): the deepest halo
+// any blur stage can use, and at least the one pixel sobel reads.
+static inline int filter_chain_halo_width(const filter_chain_t *chain,
+                                          int image_width, int image_height,
+                                          int k_regions,
+                                          const double *weights) {
+  if (k_regions <= 1) {
+    return 0;
+  }
 
-      pixel out =
-          (val_blue > 50.0f) ? (pixel){255, 255, 255} : (pixel){0, 0, 0};
-      sobel[CONV(j, k, width)] = out;
+  // Smallest block dimension across which the image is cut
+  int min_block = filter_chain_min_block(chain);
+  int grid_cols, grid_rows;
+  if (!split_grid(image_width, image_height, k_regions, min_block, &grid_cols,
+                  &grid_rows)) {
+    abort();
+  }
+  int *col_start = (int *)malloc((grid_cols + grid_rows + 2) * sizeof(int));
+  if (!col_start) {
+    abort();
+  }
+  int *row_start = col_start + grid_cols + 1;
+  split_bounds(image_width, image_height, grid_cols, grid_rows, weights,
+               min_block, col_start, row_start);
+
+  int extent = image_width > image_height ? image_width : image_height;
+  for (int c = 0; grid_cols > 1 && c < grid_cols; c++) {
+    if (col_start[c + 1] - col_start[c] < extent)
+      extent = col_start[c + 1] - col_start[c];
+  }
+  for (int r = 0; grid_rows > 1 && r < grid_rows; r++) {
+    if (row_start[r + 1] - row_start[r] < extent)
+      extent = row_start[r + 1] - row_start[r];
+  }
+  free(col_start);
+
+  int halo = 1;
+  for (int s = 0; s < chain->n_stages; s++) {
+    const filter_stage_t *stage = &chain->stages[s];
+    if (stage->kind == FILTER_STAGE_BLUR) {
+      int blur_halo = blur_halo_width(stage->radius, extent);
+      if (blur_halo > halo)
+        halo = blur_halo;
     }
   }
+  return halo;
+}
 
-  int x0 = region->region_id == 0? 1 : GHOST_WIDTH;
-  int x1 = region->region_id == region->k_regions - 1? width - 1 : width - GHOST_WIDTH;
-
-#pragma omp parallel for collapse(2) schedule(static)
-  for (int j = 1; j < height - 1; j++) {
-    for (int k = x0; k < x1; k++) {
-      p[CONV(j, k, width)] = sobel[CONV(j, k, width)];
-    }
+// Halo depth that must hold the neighbours' current values before stage runs
+// on a split region
+static inline int filter_stage_halo_need(const filter_stage_t *stage,
+                                         int ghost_width) {
+  switch (stage->kind) {
+  case FILTER_STAGE_BLUR:
+    return ghost_width;
+  case FILTER_STAGE_SOBEL:
+    return 1;
+  case FILTER_STAGE_GRAY:
+  default:
+    return 0;
   }
+}
 
-  free(sobel);
+// Halo depth still up to date after stage ran, given `valid` before it.
+// Gray is pointwise and also converts the halo; blur ends with an exchange,
+// or, if it replayed a partial time block, with at least radius valid rows
+// and columns; sobel only writes the region's own cells.
+static inline int filter_stage_halo_after(const filter_stage_t *stage,
+                                          int valid) {
+  switch (stage->kind) {
+  case FILTER_STAGE_BLUR:
+    return stage->radius;
+  case FILTER_STAGE_SOBEL:
+    return 0;
+  case FILTER_STAGE_GRAY:
+  default:
+    return valid;
+  }
 }
 
-static inline void apply_all_filters_to_region(Region *region, int blur_size,
-                                               int blur_threshold, openmp_mode_t openmp_mode) {
+static inline void apply_filter_chain_to_region(Region *region,
+                                                const filter_chain_t *chain,
+                                                openmp_mode_t openmp_mode) {
   openmp_mode_t sg_openmp_mode = openmp_mode;
   int num_threads = omp_get_max_threads();
   if (openmp_mode == OPENMP_MODE_AUTO ) {
@@ -346,16 +861,336 @@ static inline void apply_all_filters_to_region(Region *region, int blur_size,
     printf("Applying filters to region %d of image %d without OpenMP parallelization\n",
            region->region_id, region->image_id);
   }
-  
-  apply_gray_filter_to_region(region, sg_openmp_mode);
-  apply_blur_filter_to_region(region, blur_size, blur_threshold, sg_openmp_mode);
-  apply_sobel_filter_to_region(region, sg_openmp_mode);
+
+  for (int s = 0; s < chain->n_stages; s++) {
+    const filter_stage_t *stage = &chain->stages[s];
+    switch (stage->kind) {
+    case FILTER_STAGE_GRAY:
+      apply_gray_filter_to_region(region, sg_openmp_mode);
+      break;
+    case FILTER_STAGE_BLUR:
+      apply_blur_filter_to_region(region, stage->radius, stage->threshold,
+                                  sg_openmp_mode);
+      break;
+    case FILTER_STAGE_SOBEL:
+      apply_sobel_filter_to_region(region, stage->threshold, sg_openmp_mode);
+      break;
+    }
+  }
 }
 
-static inline void apply_all_filters_to_region_mpi(Region *region,
-                                                   int blur_size,
-                                                   int blur_threshold,
-                                                   MPI_Comm comm, openmp_mode_t openmp_mode) {
+// Number of tile tasks a stage working on `rows` rows of `width` pixels is
+// split into: about TASK_TILE_PIXELS pixels each, at least one row each, and
+// at most two per thread of the team, since each tile has its own scratch.
+static inline int task_tile_count(int rows, int width) {
+  long pixels = (long)rows * width;
+  long n = pixels / TASK_TILE_PIXELS;
+  int max_tiles = 2 * omp_get_num_threads();
+  if (n > max_tiles)
+    n = max_tiles;
+  if (n > rows)
+    n = rows;
+  if (n < 1)
+    n = 1;
+  return (int)n;
+}
+
+// Task versions of the filters, for unsplit regions. They must run inside a
+// parallel region; each stage is a taskloop over tiles of rows, so idle
+// threads of the team can pick tiles up.
+
+static inline void apply_gray_filter_to_region_tasks(Region *region) {
+  gray_kernel_fn gray = gray_kernel_select();
+  int n_tiles = task_tile_count(region->region_height, region->region_width);
+
+  #pragma omp taskloop grainsize(1)
+  for (int tile = 0; tile < n_tiles; tile++) {
+    gray_region_part(region, gray, tile, n_tiles);
+  }
+}
+
+static inline void apply_blur_filter_to_region_tasks(Region *region, int size,
+                                                     int threshold) {
+  int width = region->region_width;
+  blur_bands bands = blur_region_bands(region, size, 0);
+  int top_rows = bands.top_end - bands.top_begin;
+  int bottom_rows = bands.bottom_end - bands.bottom_begin;
+  int n_tiles =
+      task_tile_count(top_rows > bottom_rows ? top_rows : bottom_rows, width);
+
+  blur_scratch *scratch =
+      (blur_scratch *)malloc(n_tiles * sizeof(blur_scratch));
+  int *tile_end = (int *)malloc(n_tiles * sizeof(int));
+  if (!scratch || !tile_end) {
+    free(scratch);
+    free(tile_end);
+    return;
+  }
+  for (int i = 0; i < n_tiles; i++) {
+    if (!blur_scratch_alloc(&scratch[i], width, size)) {
+      while (i-- > 0) {
+        blur_scratch_free(&scratch[i]);
+      }
+      free(scratch);
+      free(tile_end);
+      return;
+    }
+  }
+
+  blur_row_fn row_kernel = blur_select_row(size);
+  pixel *p = region->p;
+  int end;
+
+  do {
+    #pragma omp taskloop grainsize(1)
+    for (int tile = 0; tile < n_tiles; tile++) {
+      blur_save_edges(region, p, size, 0, &scratch[tile], tile, n_tiles);
+    }
+
+    #pragma omp taskloop grainsize(1)
+    for (int tile = 0; tile < n_tiles; tile++) {
+      tile_end[tile] = blur_part_rows(region, p, row_kernel, size, threshold,
+                                      0, &scratch[tile], tile, n_tiles);
+    }
+
+    end = 1;
+    for (int tile = 0; tile < n_tiles; tile++) {
+      end &= tile_end[tile];
+    }
+  } while (threshold > 0 && !end);
+
+  for (int i = 0; i < n_tiles; i++) {
+    blur_scratch_free(&scratch[i]);
+  }
+  free(scratch);
+  free(tile_end);
+}
+
+static inline void apply_sobel_filter_to_region_tasks(Region *region,
+                                                      int threshold) {
+  int width = region->region_width;
+  int stride = region->stride;
+  pixel *p = region->p;
+
+  int x0, x1, y0, y1;
+  sobel_region_bounds(region, &x0, &x1, &y0, &y1);
+  int n_tiles = task_tile_count(y1 - y0, width);
+
+  pixel *rows = (pixel *)malloc((size_t)n_tiles * 3 * width * sizeof(pixel));
+  if (!rows) {
+    return;
+  }
+
+  sobel_rows_fn sobel = sobel_rows_select();
+
+  #pragma omp taskloop grainsize(1)
+  for (int tile = 0; tile < n_tiles; tile++) {
+    sobel_save_edges(p, width, stride, y0, y1,
+                     rows + (size_t)tile * 3 * width, tile, n_tiles);
+  }
+
+  #pragma omp taskloop grainsize(1)
+  for (int tile = 0; tile < n_tiles; tile++) {
+    sobel(p, width, stride, y0, y1, x0, x1, threshold,
+          rows + (size_t)tile * 3 * width, tile, n_tiles);
+  }
+
+  free(rows);
+}
+
+static inline void apply_filter_chain_to_region_tasks(Region *region,
+                                                      const filter_chain_t *chain) {
+  for (int s = 0; s < chain->n_stages; s++) {
+    const filter_stage_t *stage = &chain->stages[s];
+    switch (stage->kind) {
+    case FILTER_STAGE_GRAY:
+      apply_gray_filter_to_region_tasks(region);
+      break;
+    case FILTER_STAGE_BLUR:
+      apply_blur_filter_to_region_tasks(region, stage->radius,
+                                        stage->threshold);
+      break;
+    case FILTER_STAGE_SOBEL:
+      apply_sobel_filter_to_region_tasks(region, stage->threshold);
+      break;
+    }
+  }
+}
+
+// Apply chain to n small unsplit frames, each thread taking whole frames
+// dynamically and running the whole chain on one while it is in cache.
+static inline void
+apply_filter_chain_to_small_frames(Region *frames, int n,
+                                   const filter_chain_t *chain,
+                                   int use_threads) {
+  int max_width = 1;
+  for (int f = 0; f < n; f++) {
+    if (frames[f].region_width > max_width)
+      max_width = frames[f].region_width;
+  }
+
+  int max_radius = 0;
+  blur_row_fn row_kernels[FILTER_CHAIN_MAX_STAGES] = {NULL};
+  for (int s = 0; s < chain->n_stages; s++) {
+    const filter_stage_t *stage = &chain->stages[s];
+    if (stage->kind == FILTER_STAGE_BLUR) {
+      row_kernels[s] = blur_select_row(stage->radius);
+      if (stage->radius > max_radius)
+        max_radius = stage->radius;
+    }
+  }
+
+  int max_threads = use_threads ? omp_get_max_threads() : 1;
+  blur_scratch *scratch =
+      (blur_scratch *)malloc(max_threads * sizeof(blur_scratch));
+  pixel *rows =
+      (pixel *)malloc((size_t)max_threads * 3 * max_width * sizeof(pixel));
+  if (!scratch || !rows) {
+    free(scratch);
+    free(rows);
+    return;
+  }
+  for (int i = 0; i < max_threads; i++) {
+    if (!blur_scratch_alloc(&scratch[i], max_width, max_radius)) {
+      while (i-- > 0) {
+        blur_scratch_free(&scratch[i]);
+      }
+      free(scratch);
+      free(rows);
+      return;
+    }
+  }
+
+  gray_kernel_fn gray = gray_kernel_select();
+  sobel_rows_fn sobel = sobel_rows_select();
+
+  #pragma omp parallel for schedule(dynamic) num_threads(max_threads) if(use_threads)
+  for (int f = 0; f < n; f++) {
+    Region *frame = &frames[f];
+    int width = frame->region_width;
+    int height = frame->region_height;
+    pixel *p = frame->p;
+    int t = omp_get_thread_num();
+
+    for (int s = 0; s < chain->n_stages; s++) {
+      const filter_stage_t *stage = &chain->stages[s];
+      switch (stage->kind) {
+      case FILTER_STAGE_GRAY:
+        gray_region_part(frame, gray, 0, 1);
+        break;
+      case FILTER_STAGE_BLUR: {
+        blur_scratch_layout(&scratch[t], width, stage->radius);
+        int end;
+        do {
+          blur_save_edges(frame, p, stage->radius, 0, &scratch[t], 0, 1);
+          end = blur_part_rows(frame, p, row_kernels[s], stage->radius,
+                               stage->threshold, 0, &scratch[t], 0, 1);
+        } while (stage->threshold > 0 && !end);
+        break;
+      }
+      case FILTER_STAGE_SOBEL: {
+        pixel *own = rows + (size_t)t * 3 * max_width;
+        sobel_save_edges(p, width, frame->stride, 1, height - 1, own, 0, 1);
+        sobel(p, width, frame->stride, 1, height - 1, 1, width - 1,
+              stage->threshold, own, 0, 1);
+        break;
+      }
+      }
+    }
+  }
+
+  for (int i = 0; i < max_threads; i++) {
+    blur_scratch_free(&scratch[i]);
+  }
+  free(scratch);
+  free(rows);
+}
+
+// Apply chain to n independent, unsplit regions. Frames of at most
+// SMALL_FRAME_PIXELS pixels all go through one loop over whole frames. With OpenMP,
+// every other region is a task whose stages are in turn split into tile
+// tasks, so the team stays busy with tiles when there are few large frames.
+static inline void apply_filter_chain_to_regions(Region *regions, int n,
+                                                 const filter_chain_t *chain,
+                                                 openmp_mode_t openmp_mode) {
+  long total_pixels = 0;
+  int n_small = 0;
+  for (int r = 0; r < n; r++) {
+    long pixels = (long)regions[r].region_width * regions[r].region_height;
+    total_pixels += pixels;
+    if (pixels <= SMALL_FRAME_PIXELS) {
+      n_small++;
+    }
+  }
+
+  int num_threads = omp_get_max_threads();
+  int use_tasks = openmp_mode == OPENMP_MODE_FORCE;
+  if (openmp_mode == OPENMP_MODE_AUTO) {
+    use_tasks = total_pixels > OPENMP_THRESHOLD &&
+                num_threads > OPENMP_THREADS_THRESHOLD;
+  }
+
+  if (n_small > 0) {
+    // Regions are only descriptors, so the small ones can be gathered into
+    // their own array and the rest filtered from a compacted copy
+    Region *small = regions;
+    Region *large = NULL;
+    if (n_small < n) {
+      small = (Region *)malloc(n * sizeof(Region));
+      if (!small) {
+        return;
+      }
+      large = small + n_small;
+      int i_small = 0, i_large = 0;
+      for (int r = 0; r < n; r++) {
+        if ((long)regions[r].region_width * regions[r].region_height <=
+            SMALL_FRAME_PIXELS) {
+          small[i_small++] = regions[r];
+        } else {
+          large[i_large++] = regions[r];
+        }
+      }
+    }
+
+    if (use_tasks) {
+      printf("Applying filters to %d small region(s) frame by frame using %d threads\n",
+             n_small, num_threads);
+    } else {
+      printf("Applying filters to %d small region(s) frame by frame without OpenMP parallelization\n",
+             n_small);
+    }
+    apply_filter_chain_to_small_frames(small, n_small, chain, use_tasks);
+
+    if (large) {
+      apply_filter_chain_to_regions(large, n - n_small, chain, openmp_mode);
+    }
+    if (small != regions) {
+      free(small);
+    }
+    return;
+  }
+
+  if (!use_tasks) {
+    for (int r = 0; r < n; r++) {
+      apply_filter_chain_to_region(&regions[r], chain, OPENMP_MODE_OFF);
+    }
+    return;
+  }
+
+  printf("Applying filters to %d region(s) as OpenMP tasks using %d threads\n",
+         n, num_threads);
+
+  #pragma omp parallel
+  #pragma omp single
+  for (int r = 0; r < n; r++) {
+    #pragma omp task
+    apply_filter_chain_to_region_tasks(&regions[r], chain);
+  }
+}
+
+static inline void apply_filter_chain_to_region_mpi(Region *region,
+                                                    const filter_chain_t *chain,
+                                                    MPI_Comm comm, openmp_mode_t openmp_mode) {
   openmp_mode_t blur_openmp_mode = openmp_mode;
   openmp_mode_t sg_openmp_mode = openmp_mode;
   int num_threads = omp_get_max_threads();
@@ -391,10 +1226,30 @@ static inline void apply_all_filters_to_region_mpi(Region *region,
     printf("Applying blur filter to region %d of image %d without OpenMP parallelization\n",
            region->region_id, region->image_id);
   }
-  
-  apply_gray_filter_to_region(region, sg_openmp_mode);
-  apply_blur_filter_to_region_mpi(region, blur_size, blur_threshold, comm, blur_openmp_mode);
-  apply_sobel_filter_to_region(region, sg_openmp_mode);
+
+  int halo_valid = region->ghost_width;
+  for (int s = 0; s < chain->n_stages; s++) {
+    const filter_stage_t *stage = &chain->stages[s];
+    if (region->k_regions > 1 &&
+        filter_stage_halo_need(stage, region->ghost_width) > halo_valid) {
+      exchange_ghost_cells(region, comm, sg_openmp_mode);
+      halo_valid = region->ghost_width;
+    }
+
+    switch (stage->kind) {
+    case FILTER_STAGE_GRAY:
+      apply_gray_filter_to_region(region, sg_openmp_mode);
+      break;
+    case FILTER_STAGE_BLUR:
+      apply_blur_filter_to_region_mpi(region, stage->radius, stage->threshold,
+                                      comm, blur_openmp_mode);
+      break;
+    case FILTER_STAGE_SOBEL:
+      apply_sobel_filter_to_region(region, stage->threshold, sg_openmp_mode);
+      break;
+    }
+    halo_valid = filter_stage_halo_after(stage, halo_valid);
+  }
 }
 
 #endif
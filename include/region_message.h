@@ -0,0 +1,165 @@
+#ifndef REGION_MESSAGE_H
+#define REGION_MESSAGE_H
+
+#include "split.h"
+#include <limits.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Wire format of the master/worker protocol. Every transfer is a single
+// message: a message_header, then `count` records, each a region_header
+// followed by the region's pixels row after row. The command a message
+// carries is its tag. Receivers size their buffer with MPI_Mprobe and
+// MPI_Get_count, and take the regions as views into it, so nothing is packed
+// or unpacked on the way. Every rank runs the same binary, so the structs
+// travel as raw bytes.
+
+typedef struct {
+  int count;      // Records following the header
+  double seconds; // Time the sender spent filtering them (chunk results)
+} message_header;
+
+typedef struct {
+  int image_id;
+  int region_id;
+  int region_width;
+  int region_height;
+  int k_regions;
+  int ghost_width;
+  int grid_cols;
+  int x_offset;
+  int y_offset;
+  int frame_height;
+} region_header;
+
+// Size in bytes of the record of region in a message
+static inline size_t region_record_size(const Region *region) {
+  return sizeof(region_header) + (size_t)region->region_width *
+                                     region->region_height * sizeof(pixel);
+}
+
+// Size in bytes of a message holding count regions. MPI counts are ints:
+// aborts if the message would be larger (see region_message_fit).
+static inline int region_message_size(const Region *regions, int count) {
+  size_t size = sizeof(message_header);
+  for (int r = 0; r < count; r++) {
+    size += region_record_size(&regions[r]);
+    if (size > INT_MAX) {
+      fprintf(stderr, "Message of %d region(s) exceeds %d bytes\n", count,
+              INT_MAX);
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+  }
+  return (int)size;
+}
+
+// Number of the first of count regions that fit in one message, at most
+// INT_MAX bytes long; 0 if even the first one does not
+static inline int region_message_fit(const Region *regions, int count) {
+  size_t size = sizeof(message_header);
+  for (int r = 0; r < count; r++) {
+    size += region_record_size(&regions[r]);
+    if (size > INT_MAX) {
+      return r;
+    }
+  }
+  return count;
+}
+
+// Write a message holding count regions into buffer, region_message_size
+// bytes long. Regions may be views into a wider frame.
+static inline void region_message_write(char *buffer, const Region *regions,
+                                        int count, double seconds) {
+  message_header header = {count, seconds};
+  memcpy(buffer, &header, sizeof(header));
+  char *at = buffer + sizeof(header);
+
+  for (int r = 0; r < count; r++) {
+    const Region *region = &regions[r];
+    region_header record = {region->image_id,      region->region_id,
+                            region->region_width,  region->region_height,
+                            region->k_regions,     region->ghost_width,
+                            region->grid_cols,     region->x_offset,
+                            region->y_offset,      region->frame_height};
+    memcpy(at, &record, sizeof(record));
+    at += sizeof(record);
+
+    copy_rows((pixel *)at, region->region_width, region->p, region->stride,
+              region->region_width, region->region_height);
+    at += (size_t)region->region_width * region->region_height * sizeof(pixel);
+  }
+}
+
+// Regions of the message in buffer, as views into it, valid as long as the
+// buffer is. The header is copied into *header. The array is to be freed by
+// the caller.
+static inline Region *region_message_read(char *buffer,
+                                          message_header *header) {
+  memcpy(header, buffer, sizeof(*header));
+  char *at = buffer + sizeof(*header);
+
+  Region *regions =
+      (Region *)malloc((header->count > 0 ? header->count : 1) *
+                       sizeof(Region));
+  for (int r = 0; r < header->count; r++) {
+    region_header record;
+    memcpy(&record, at, sizeof(record));
+    at += sizeof(record);
+
+    Region *region = &regions[r];
+    region->image_id = record.image_id;
+    region->region_id = record.region_id;
+    region->region_width = record.region_width;
+    region->region_height = record.region_height;
+    region->k_regions = record.k_regions;
+    region->ghost_width = record.ghost_width;
+    region->grid_cols = record.grid_cols;
+    region->grid_rows = record.k_regions / record.grid_cols;
+    region->x_offset = record.x_offset;
+    region->y_offset = record.y_offset;
+    region->frame_height = record.frame_height;
+    region->p = (pixel *)at;
+    region->stride = record.region_width;
+    at += (size_t)record.region_width * record.region_height * sizeof(pixel);
+  }
+  return regions;
+}
+
+// Receive a matched message into a buffer of its size. Returns the buffer,
+// to be freed by the caller, and its size in *size.
+static inline char *message_receive_matched(MPI_Message *message,
+                                            MPI_Status *status, int *size) {
+  MPI_Get_count(status, MPI_BYTE, size);
+  char *buffer = (char *)malloc(*size > 0 ? *size : 1);
+  if (!buffer) {
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+  MPI_Mrecv(buffer, *size, MPI_BYTE, message, MPI_STATUS_IGNORE);
+  return buffer;
+}
+
+// Receive the next message from source with tag (wildcards allowed), see
+// message_receive_matched. Its source and tag are in *status.
+static inline char *message_receive(int source, int tag, MPI_Comm comm,
+                                    MPI_Status *status, int *size) {
+  MPI_Message message;
+  MPI_Mprobe(source, tag, comm, &message, status);
+  return message_receive_matched(&message, status, size);
+}
+
+// Same as message_receive, but returns NULL at once if no message has
+// arrived
+static inline char *message_poll(int source, int tag, MPI_Comm comm,
+                                 MPI_Status *status, int *size) {
+  MPI_Message message;
+  int arrived;
+  MPI_Improbe(source, tag, comm, &arrived, &message, status);
+  if (!arrived) {
+    return NULL;
+  }
+  return message_receive_matched(&message, status, size);
+}
+
+#endif // REGION_MESSAGE_H
@@ -1,5 +1,8 @@
 #ifndef RUNTIME_CONFIG_H
 #define RUNTIME_CONFIG_H
+
+#include "filter_chain.h"
+
 typedef enum {
   MPI_MODE_OFF,
   MPI_MODE_AUTO,
@@ -19,10 +22,30 @@ typedef enum {
   CUDA_MODE_FORCE
 } cuda_mode_t;
 
+typedef enum {
+  BALANCE_MODE_OFF,
+  BALANCE_MODE_AUTO
+} balance_mode_t;
+
+typedef enum {
+  SHM_MODE_OFF,
+  SHM_MODE_AUTO
+} shm_mode_t;
+
+typedef enum {
+  COLLECTIVE_MODE_OFF,
+  COLLECTIVE_MODE_AUTO,
+  COLLECTIVE_MODE_FORCE
+} collective_mode_t;
+
 typedef struct {
   mpi_mode_t mpi_mode;
   openmp_mode_t openmp_mode;
   cuda_mode_t cuda_mode;
+  balance_mode_t balance_mode; // Share work out by measured rank throughput
+  shm_mode_t shm_mode; // Hand frames to ranks of rank 0's node in shared memory
+  collective_mode_t collective_mode; // Scatter/gather split image blocks
+  filter_chain_t chain; // Stages applied to every frame, already planned
 } runtime_config_t;
 
 // #define OPENMP_COARSE_THRESHOLD 30
@@ -31,5 +54,26 @@ typedef struct {
 #define GHOST_OPENMP_THRESHOLD 200000
 #define GHOST_OPENMP_THREADS_THRESHOLD 6
 #define CUDA_THRESHOLD 20000000
+// Blur iterations run between two halo exchanges on split images
+#define BLUR_TIME_BLOCK 4
+// Target number of pixels of one tile task when frames run as OpenMP tasks
+#define TASK_TILE_PIXELS 65536
+// Most pixels per thread the master filters in one turn of the work queue,
+// between two polls for worker results
+#define MASTER_TURN_PIXELS TASK_TILE_PIXELS
+// Unsplit frames up to this many pixels are too small to split into tiles; a
+// batch of them is filtered in one loop, each thread taking whole frames
+#define SMALL_FRAME_PIXELS TASK_TILE_PIXELS
+// Side of the synthetic frame each rank filters to measure its throughput
+#define BALANCE_CALIBRATION_SIZE 512
+// Fewest input pixels worth measuring rank throughputs for: below, the
+// calibration frame would cost more than uneven shares lose
+#define BALANCE_MIN_PIXELS                                                     \
+  (64L * BALANCE_CALIBRATION_SIZE * BALANCE_CALIBRATION_SIZE)
+// Largest ratio between the shares of the fastest and the slowest rank
+#define BALANCE_MAX_RATIO 4.0
+// Ranks from which split image blocks are scattered and gathered with
+// collectives rather than sent one by one from rank 0
+#define COLLECTIVE_MIN_RANKS 8
 
 #endif // RUNTIME_CONFIG_H
\ No newline at end of file
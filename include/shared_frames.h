@@ -0,0 +1,289 @@
+#ifndef SHARED_FRAMES_H
+#define SHARED_FRAMES_H
+
+#include "gif_model.h"
+#include "split.h"
+#include <mpi.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Frames shared by rank 0 with the ranks of its node in one MPI-3 window, so
+// that their work queue chunks are sent as frame indices. Kept in one
+// lock_all epoch; each side syncs the window when frames change hands.
+typedef struct {
+  MPI_Comm node;    // Ranks sharing rank 0's node, MPI_COMM_NULL if none
+  MPI_Win win;
+  pixel *base;      // First pixel of the arena
+  int n_frames;
+  int *width;
+  int *height;
+  MPI_Aint *offset; // First pixel of every frame, counted from base
+} shared_frames;
+
+// Communicator of the ranks sharing rank 0's node, or MPI_COMM_NULL on the
+// other nodes and when rank 0 is alone on its node. Collective over world.
+static inline MPI_Comm shared_frames_node(MPI_Comm world) {
+  int rank;
+  MPI_Comm_rank(world, &rank);
+
+  // Keyed by world rank, so that rank 0 is the first rank of its node
+  MPI_Comm node;
+  MPI_Comm_split_type(world, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+
+  int leader = rank;
+  int node_size;
+  MPI_Bcast(&leader, 1, MPI_INT, 0, node);
+  MPI_Comm_size(node, &node_size);
+  if (leader != 0 || node_size < 2) {
+    MPI_Comm_free(&node);
+    return MPI_COMM_NULL;
+  }
+  return node;
+}
+
+// Share the frame table of the arena with the rest of the node and open the
+// access epoch
+static inline void shared_frames_publish(shared_frames *frames) {
+  MPI_Bcast(&frames->n_frames, 1, MPI_INT, 0, frames->node);
+  if (!frames->width) {
+    frames->width = (int *)malloc(frames->n_frames * sizeof(int));
+    frames->height = (int *)malloc(frames->n_frames * sizeof(int));
+    frames->offset = (MPI_Aint *)malloc(frames->n_frames * sizeof(MPI_Aint));
+    if (!frames->width || !frames->height || !frames->offset) {
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+  }
+  MPI_Bcast(frames->width, frames->n_frames, MPI_INT, 0, frames->node);
+  MPI_Bcast(frames->height, frames->n_frames, MPI_INT, 0, frames->node);
+  MPI_Bcast(frames->offset, frames->n_frames, MPI_AINT, 0, frames->node);
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, frames->win);
+}
+
+// On rank 0: allocate the arena on node, move every frame of image into it
+// and point image->p at the copies, which are filtered and stored from there
+static inline void shared_frames_create(shared_frames *frames, MPI_Comm node,
+                                        animated_gif *image) {
+  memset(frames, 0, sizeof(*frames));
+  frames->node = node;
+  frames->n_frames = image->n_images;
+  frames->width = (int *)malloc(image->n_images * sizeof(int));
+  frames->height = (int *)malloc(image->n_images * sizeof(int));
+  frames->offset = (MPI_Aint *)malloc(image->n_images * sizeof(MPI_Aint));
+  if (!frames->width || !frames->height || !frames->offset) {
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+
+  MPI_Aint total = 0;
+  for (int i = 0; i < image->n_images; i++) {
+    frames->width[i] = image->width[i];
+    frames->height[i] = image->height[i];
+    frames->offset[i] = total;
+    total += (MPI_Aint)image->width[i] * image->height[i];
+  }
+
+  MPI_Win_allocate_shared(total * (MPI_Aint)sizeof(pixel), sizeof(pixel),
+                          MPI_INFO_NULL, node, &frames->base, &frames->win);
+  for (int i = 0; i < image->n_images; i++) {
+    pixel *p = frames->base + frames->offset[i];
+    memcpy(p, image->p[i],
+           (size_t)image->width[i] * image->height[i] * sizeof(pixel));
+    free(image->p[i]);
+    image->p[i] = p;
+  }
+
+  shared_frames_publish(frames);
+  MPI_Win_sync(frames->win);
+}
+
+// On the other ranks of rank 0's node: map the arena rank 0 allocated
+static inline void shared_frames_attach(shared_frames *frames, MPI_Comm node) {
+  memset(frames, 0, sizeof(*frames));
+  frames->node = node;
+
+  MPI_Aint size;
+  int disp_unit;
+  MPI_Win_allocate_shared(0, sizeof(pixel), MPI_INFO_NULL, node, &frames->base,
+                          &frames->win);
+  MPI_Win_shared_query(frames->win, 0, &size, &disp_unit, &frames->base);
+
+  shared_frames_publish(frames);
+  MPI_Win_sync(frames->win);
+}
+
+// Views of count frames of the arena, in the order of ids, to be filtered in
+// place. The array is to be freed by the caller.
+static inline Region *shared_frames_views(const shared_frames *frames,
+                                          const int *ids, int count) {
+  Region *regions = (Region *)malloc(count * sizeof(Region));
+  for (int r = 0; r < count; r++) {
+    int i = ids[r];
+    Region *view = Split(frames->base + frames->offset[i], i, frames->width[i],
+                         frames->height[i], 1, 0, NULL);
+    regions[r] = view[0];
+    free(view);
+  }
+  return regions;
+}
+
+// Close the epoch and release the arena. Collective over the node; on rank 0
+// the frames of the image are gone afterwards.
+static inline void shared_frames_free(shared_frames *frames) {
+  if (frames->node == MPI_COMM_NULL) {
+    return;
+  }
+  MPI_Win_unlock_all(frames->win);
+  MPI_Win_free(&frames->win);
+  MPI_Comm_free(&frames->node);
+  free(frames->width);
+  free(frames->height);
+  free(frames->offset);
+  memset(frames, 0, sizeof(*frames));
+  frames->node = MPI_COMM_NULL;
+}
+
+// Slots for the blocks of split images in one window shared by every rank on
+// one node, kept for the run. Halo exchanges copy from the neighbours' slots.
+typedef struct {
+  int state;         // 0 until first reserved, 1 if shared, -1 if not
+  MPI_Comm node;     // Every rank, in world order
+  int rank;          // This rank in node
+  MPI_Win win;
+  MPI_Aint capacity; // Bytes of every slot
+  char **slot;       // Slot of every rank, as mapped by this rank
+  pixel **base;      // Block of every rank, as mapped by this rank
+  int *geometry;     // x_offset, y_offset and stride of every rank's block
+} region_window;
+
+// Attribute key of the window on a grid communicator
+static inline int region_window_keyval(void) {
+  static int keyval = MPI_KEYVAL_INVALID;
+  if (keyval == MPI_KEYVAL_INVALID) {
+    MPI_Comm_create_keyval(MPI_COMM_NULL_COPY_FN, MPI_COMM_NULL_DELETE_FN,
+                           &keyval, NULL);
+  }
+  return keyval;
+}
+
+// Window holding the blocks of grid, or NULL if they are in private memory
+static inline const region_window *region_window_of(MPI_Comm grid) {
+  void *window;
+  int found;
+  MPI_Comm_get_attr(grid, region_window_keyval(), &window, &found);
+  return found ? (const region_window *)window : NULL;
+}
+
+// This rank's slot, at least size bytes, or NULL if the ranks of world span
+// several nodes. Collective over world.
+static inline char *region_window_reserve(region_window *window,
+                                          MPI_Aint size, MPI_Comm world) {
+  if (window->state == 0) {
+    int world_rank, world_size, node_size;
+    MPI_Comm_rank(world, &world_rank);
+    MPI_Comm_size(world, &world_size);
+    MPI_Comm_split_type(world, MPI_COMM_TYPE_SHARED, world_rank,
+                        MPI_INFO_NULL, &window->node);
+    MPI_Comm_size(window->node, &node_size);
+    // Same answer on every rank: either one node holds them all or none does
+    if (node_size != world_size) {
+      MPI_Comm_free(&window->node);
+      window->state = -1;
+      return NULL;
+    }
+    MPI_Comm_rank(window->node, &window->rank);
+    window->win = MPI_WIN_NULL;
+    window->capacity = 0;
+    window->slot = (char **)malloc(node_size * sizeof(char *));
+    window->base = (pixel **)malloc(node_size * sizeof(pixel *));
+    window->geometry = (int *)malloc(3 * node_size * sizeof(int));
+    if (!window->slot || !window->base || !window->geometry) {
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    window->state = 1;
+  }
+  if (window->state < 0) {
+    return NULL;
+  }
+
+  int grow = size > window->capacity;
+  MPI_Allreduce(MPI_IN_PLACE, &grow, 1, MPI_INT, MPI_LOR, window->node);
+  if (grow) {
+    if (window->win != MPI_WIN_NULL) {
+      MPI_Win_unlock_all(window->win);
+      MPI_Win_free(&window->win);
+    }
+    MPI_Allreduce(&size, &window->capacity, 1, MPI_AINT, MPI_MAX,
+                  window->node);
+
+    // Every slot on pages of its own rank, rather than one contiguous arena
+    MPI_Info info;
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "alloc_shared_noncontig", "true");
+    char *own;
+    MPI_Win_allocate_shared(window->capacity, 1, info, window->node, &own,
+                            &window->win);
+    MPI_Info_free(&info);
+
+    int node_size;
+    MPI_Comm_size(window->node, &node_size);
+    for (int r = 0; r < node_size; r++) {
+      MPI_Aint slot_size;
+      int disp_unit;
+      MPI_Win_shared_query(window->win, r, &slot_size, &disp_unit,
+                           &window->slot[r]);
+    }
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, window->win);
+  }
+  return window->slot[window->rank];
+}
+
+// Publish where region, which lies in this rank's slot, sits and cache the
+// window on grid; returns 0 if grid is not every rank of the window.
+// Collective over grid.
+static inline int region_window_attach(region_window *window,
+                                       const Region *region, MPI_Comm grid) {
+  int grid_size, node_size;
+  MPI_Comm_size(grid, &grid_size);
+  MPI_Comm_size(window->node, &node_size);
+  if (grid_size != node_size) {
+    return 0;
+  }
+
+  int offset = (int)((char *)region->p - window->slot[window->rank]);
+  int geometry[4] = {region->x_offset, region->y_offset, region->stride,
+                     offset};
+  int *all = (int *)malloc(4 * node_size * sizeof(int));
+  if (!all) {
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+  MPI_Allgather(geometry, 4, MPI_INT, all, 4, MPI_INT, window->node);
+  for (int r = 0; r < node_size; r++) {
+    memcpy(&window->geometry[3 * r], &all[4 * r], 3 * sizeof(int));
+    window->base[r] = (pixel *)(window->slot[r] + all[4 * r + 3]);
+  }
+  free(all);
+
+  MPI_Comm_set_attr(grid, region_window_keyval(), window);
+  return 1;
+}
+
+// Forget the window on grid; the blocks stay in their slots
+static inline void region_window_detach(MPI_Comm grid) {
+  MPI_Comm_delete_attr(grid, region_window_keyval());
+}
+
+// Release the window. Collective over every rank that reserved it.
+static inline void region_window_free(region_window *window) {
+  if (window->state > 0) {
+    if (window->win != MPI_WIN_NULL) {
+      MPI_Win_unlock_all(window->win);
+      MPI_Win_free(&window->win);
+    }
+    MPI_Comm_free(&window->node);
+    free(window->slot);
+    free(window->base);
+    free(window->geometry);
+  }
+  memset(window, 0, sizeof(*window));
+}
+
+#endif // SHARED_FRAMES_H
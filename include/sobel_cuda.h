@@ -23,11 +23,12 @@ extern void apply_gray_filter_to_region_cuda(pixel *region_pixels, int width,
 extern void apply_blur_filter_to_region_cuda(pixel *region_pixels, int width,
                                              int height, int size,
                                              int threshold, int region_id,
-                                             int k_regions);
+                                             int k_regions, int ghost_width);
 
 extern void apply_sobel_filter_to_region_cuda(pixel *region_pixels, int width,
-                                              int height, int ghost_width,
-                                              int region_id, int k_regions);
+                                              int height, int threshold,
+                                              int ghost_width, int region_id,
+                                              int k_regions);
 
 #endif /* USE_CUDA */
 
@@ -67,13 +68,15 @@ static inline void apply_sobel_filter_dispatch(animated_gif *image,
 #endif
 }
 
+// The CUDA region kernels expect packed rows, so regions that are views into
+// a wider frame (the local strip of a split image) stay on the CPU.
 static inline void apply_gray_filter_to_region_dispatch(Region *region,
                                                         int use_gpu, runtime_config_t config) {
   if (!region || !region->p)
     return;
 
 #ifdef USE_CUDA
-  if (use_gpu && cuda_is_available() && config.cuda_mode != CUDA_MODE_OFF) {
+  if (use_gpu && cuda_is_available() && region_is_contiguous(region) && config.cuda_mode != CUDA_MODE_OFF) {
     apply_gray_filter_to_region_cuda(region->p, region->region_width,
                                      region->region_height);
     return;
@@ -110,10 +113,11 @@ static inline void apply_blur_filter_to_region_dispatch(Region *region,
     return;
 
 #ifdef USE_CUDA
-  if (use_gpu && cuda_is_available() && config.cuda_mode != CUDA_MODE_OFF) {
+  if (use_gpu && cuda_is_available() && region_is_contiguous(region) && config.cuda_mode != CUDA_MODE_OFF) {
     apply_blur_filter_to_region_cuda(region->p, region->region_width,
                                      region->region_height, size, threshold,
-                                     region->region_id, region->k_regions);
+                                     region->region_id, region->k_regions,
+                                     region->ghost_width);
     return;
   }
 #else
@@ -158,7 +162,8 @@ static inline void apply_blur_filter_to_region_mpi_dispatch(
   if (use_gpu && cuda_is_available() && region->k_regions == 1 && config.cuda_mode != CUDA_MODE_OFF) {
     apply_blur_filter_to_region_cuda(region->p, region->region_width,
                                      region->region_height, size, threshold,
-                                     region->region_id, region->k_regions);
+                                     region->region_id, region->k_regions,
+                                     region->ghost_width);
     return;
   }
   else if (region->k_regions > 1) {
@@ -190,16 +195,20 @@ static inline void apply_blur_filter_to_region_mpi_dispatch(
 }
 
 static inline void apply_sobel_filter_to_region_dispatch(Region *region,
+                                                         int threshold,
                                                          int use_gpu, 
                                                          runtime_config_t config) {
   if (!region || !region->p)
     return;
 
 #ifdef USE_CUDA
-  if (use_gpu && cuda_is_available() && config.cuda_mode != CUDA_MODE_OFF) {
+  // The CUDA sobel kernel only knows about column strips
+  if (use_gpu && cuda_is_available() && region_is_contiguous(region) &&
+      region->grid_rows == 1 && config.cuda_mode != CUDA_MODE_OFF) {
     apply_sobel_filter_to_region_cuda(region->p, region->region_width,
-                                      region->region_height, GHOST_WIDTH,
-                                      region->region_id, region->k_regions);
+                                      region->region_height, threshold,
+                                      region->ghost_width, region->region_id,
+                                      region->k_regions);
     return;
   }
 #else
@@ -224,13 +233,11 @@ static inline void apply_sobel_filter_to_region_dispatch(Region *region,
     printf("Applying sobel to region %d of image %d without OpenMP parallelization\n",
            region->region_id, region->image_id);
   }
-  apply_sobel_filter_to_region(region, sg_openmp_mode);
+  apply_sobel_filter_to_region(region, threshold, sg_openmp_mode);
 }
 
-static inline void apply_all_filters_to_region_gpu(Region *region,
-                                                   int blur_size,
-                                                   int blur_threshold,
-                                                   int use_gpu, runtime_config_t config) {
+static inline void apply_filter_chain_to_region_gpu(Region *region,
+                                                    int use_gpu, runtime_config_t config) {
   if (use_gpu && config.cuda_mode == CUDA_MODE_AUTO) {
     if (region->region_height * region->region_width > CUDA_THRESHOLD) {
       use_gpu = 1;
@@ -243,17 +250,46 @@ static inline void apply_all_filters_to_region_gpu(Region *region,
   if (config.cuda_mode == CUDA_MODE_OFF) {
     printf("Warning: Cuda disabled in runtime config, using CPU for all filters\n");
   }
-  apply_gray_filter_to_region_dispatch(region, use_gpu, config);
-  apply_blur_filter_to_region_dispatch(region, blur_size, blur_threshold,
-                                       use_gpu, config);
-  apply_sobel_filter_to_region_dispatch(region, use_gpu, config);
+  for (int s = 0; s < config.chain.n_stages; s++) {
+    const filter_stage_t *stage = &config.chain.stages[s];
+    switch (stage->kind) {
+    case FILTER_STAGE_GRAY:
+      apply_gray_filter_to_region_dispatch(region, use_gpu, config);
+      break;
+    case FILTER_STAGE_BLUR:
+      apply_blur_filter_to_region_dispatch(region, stage->radius,
+                                           stage->threshold, use_gpu, config);
+      break;
+    case FILTER_STAGE_SOBEL:
+      apply_sobel_filter_to_region_dispatch(region, stage->threshold, use_gpu,
+                                            config);
+      break;
+    }
+  }
+}
+
+// Apply the chain to a batch of independent, unsplit regions. When the GPU
+// may be used, regions go through it one after the other as before;
+// otherwise the whole batch is scheduled as OpenMP tasks.
+static inline void apply_filter_chain_to_regions_gpu(Region *regions, int n,
+                                                     int use_gpu,
+                                                     runtime_config_t config) {
+  if (use_gpu && config.cuda_mode != CUDA_MODE_OFF) {
+    for (int r = 0; r < n; r++) {
+      apply_filter_chain_to_region_gpu(&regions[r], use_gpu, config);
+    }
+    return;
+  }
+  if (config.cuda_mode == CUDA_MODE_OFF) {
+    printf("Warning: Cuda disabled in runtime config, using CPU for all filters\n");
+  }
+
+  apply_filter_chain_to_regions(regions, n, &config.chain, config.openmp_mode);
 }
 
-static inline void apply_all_filters_to_region_mpi_gpu(Region *region,
-                                                       int blur_size,
-                                                       int blur_threshold,
-                                                       MPI_Comm comm,
-                                                       int use_gpu, runtime_config_t config) {
+static inline void apply_filter_chain_to_region_mpi_gpu(Region *region,
+                                                        MPI_Comm comm,
+                                                        int use_gpu, runtime_config_t config) {
   if (use_gpu && config.cuda_mode == CUDA_MODE_AUTO) {
     if (region->region_height * region->region_width > CUDA_THRESHOLD) {
       use_gpu = 1;
@@ -266,10 +302,34 @@ static inline void apply_all_filters_to_region_mpi_gpu(Region *region,
   if (config.cuda_mode == CUDA_MODE_OFF) {
     printf("Warning: Cuda disabled in runtime config, using CPU for all filters\n");
   }
-  apply_gray_filter_to_region_dispatch(region, use_gpu, config);
-  apply_blur_filter_to_region_mpi_dispatch(region, blur_size, blur_threshold,
-                                           comm, use_gpu, config);
-  apply_sobel_filter_to_region_dispatch(region, use_gpu, config);
+
+  // Refresh the halo only when the next stage reads more of it than the
+  // previous stages left up to date
+  int halo_valid = region->ghost_width;
+  for (int s = 0; s < config.chain.n_stages; s++) {
+    const filter_stage_t *stage = &config.chain.stages[s];
+    if (region->k_regions > 1 &&
+        filter_stage_halo_need(stage, region->ghost_width) > halo_valid) {
+      exchange_ghost_cells(region, comm, config.openmp_mode);
+      halo_valid = region->ghost_width;
+    }
+
+    switch (stage->kind) {
+    case FILTER_STAGE_GRAY:
+      apply_gray_filter_to_region_dispatch(region, use_gpu, config);
+      break;
+    case FILTER_STAGE_BLUR:
+      apply_blur_filter_to_region_mpi_dispatch(region, stage->radius,
+                                               stage->threshold, comm, use_gpu,
+                                               config);
+      break;
+    case FILTER_STAGE_SOBEL:
+      apply_sobel_filter_to_region_dispatch(region, stage->threshold, use_gpu,
+                                            config);
+      break;
+    }
+    halo_valid = filter_stage_halo_after(stage, halo_valid);
+  }
 }
 
 #endif /* SOBEL_CUDA_H */
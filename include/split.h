@@ -1,122 +1,259 @@
 #ifndef SPLIT_H
 #define SPLIT_H
+#include "gif_math.h"
 #include "gif_model.h"
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Represents smallest task which distributes over MPI and is being feeded to
 // openmp runtime: either whole image or part of splitting.
+//
+// A frame is split into a grid of grid_rows x grid_cols blocks, numbered row
+// by row (region_id), and each block carries up to ghost_width halo rows and
+// columns on every side it shares with a neighbour.
+//
+// A region is a view: p points at its first pixel (halo included) and rows
+// are stride pixels apart. Regions processed on the rank that holds the frame
+// look straight into the frame, so nothing is copied; regions received from
+// another rank look into the message they came in (see region_message.h).
 typedef struct Region {
   int image_id;  // For distinguishing from regions of other images
   int region_id; // For sorting inside one image
   int region_width;
   int region_height;
   int k_regions;
-  pixel *p;
+  int ghost_width;  // Halo depth on each side shared with a neighbour
+  int grid_cols;    // Blocks per row of the grid
+  int grid_rows;    // Blocks per column of the grid
+  int x_offset;     // Frame column of the region's first column
+  int y_offset;     // Frame row of the region's first row
+  int frame_height; // Height of the whole frame
+  pixel *p;         // First pixel of the region
+  int stride;       // Distance in pixels between two rows of p
 } Region;
 
+static inline int region_grid_x(const Region *region) {
+  return region->region_id % region->grid_cols;
+}
+
+static inline int region_grid_y(const Region *region) {
+  return region->region_id / region->grid_cols;
+}
+
+// Whether the region has a neighbour on each side, and thus a halo there
+static inline bool region_has_left(const Region *region) {
+  return region_grid_x(region) > 0;
+}
+
+static inline bool region_has_right(const Region *region) {
+  return region_grid_x(region) < region->grid_cols - 1;
+}
+
+static inline bool region_has_top(const Region *region) {
+  return region_grid_y(region) > 0;
+}
+
+static inline bool region_has_bottom(const Region *region) {
+  return region_grid_y(region) < region->grid_rows - 1;
+}
+
+// Copy `rows` rows of `width` pixels, with a single memcpy when both sides
+// are packed
+static inline void copy_rows(pixel *dst, int dst_stride, const pixel *src,
+                             int src_stride, int width, int rows) {
+  if (dst_stride == width && src_stride == width) {
+    memcpy(dst, src, (size_t)width * rows * sizeof(pixel));
+    return;
+  }
+  for (int y = 0; y < rows; y++) {
+    memcpy(&dst[(size_t)y * dst_stride], &src[(size_t)y * src_stride],
+           (size_t)width * sizeof(pixel));
+  }
+}
+
+// Whether the rows of region are packed, as GPU kernels expect
+static inline bool region_is_contiguous(const Region *region) {
+  return region->stride == region->region_width;
+}
+
+// Grid of k_regions blocks for an image: among the factorizations
+// cols x rows = k_regions leaving every block at least min_block pixels
+// across each cut (a halo must fit in its neighbour), the one with the
+// shortest cut between blocks, (cols - 1) full-height cuts plus (rows - 1)
+// full-width ones, since halo traffic is proportional to it. Ties go to fewer
+// rows. Returns 0 if no factorization fits the image.
+static inline int split_grid(int image_width, int image_height,
+                             int k_regions, int min_block, int *grid_cols,
+                             int *grid_rows) {
+  long best_cut = -1;
+  *grid_cols = k_regions;
+  *grid_rows = 1;
+  if (min_block < 1)
+    min_block = 1;
+
+  for (int rows = 1; rows <= k_regions; rows++) {
+    if (k_regions % rows != 0) {
+      continue;
+    }
+    int cols = k_regions / rows;
+    if ((long)cols * (cols > 1 ? min_block : 1) > image_width ||
+        (long)rows * (rows > 1 ? min_block : 1) > image_height) {
+      continue;
+    }
+    long cut = (long)(cols - 1) * image_height + (long)(rows - 1) * image_width;
+    if (best_cut < 0 || cut < best_cut) {
+      best_cut = cut;
+      *grid_cols = cols;
+      *grid_rows = rows;
+    }
+  }
+  return best_cut >= 0;
+}
+
+// Frame columns and rows at which the blocks of a grid_cols x grid_rows grid
+// start: grid column c spans [col_start[c], col_start[c + 1]) and grid row r
+// spans [row_start[r], row_start[r + 1]). Without weights the blocks have
+// equal sizes, the last ones taking the remainder. With weights (one per
+// region, e.g. the throughput of the rank that filters it) each grid column
+// gets a width proportional to the total weight of its blocks, and each grid
+// row a height proportional to the total weight of its blocks, every block
+// keeping at least min_block pixels, the floor split_grid chose the grid for.
+static inline void split_bounds(int image_width, int image_height,
+                                int grid_cols, int grid_rows,
+                                const double *weights, int min_block,
+                                int *col_start, int *row_start) {
+  int n[2] = {grid_cols, grid_rows};
+  int size[2] = {image_width, image_height};
+  int *start[2] = {col_start, row_start};
+
+  for (int axis = 0; axis < 2; axis++) {
+    double total = 0.0;
+    if (weights) {
+      for (int i = 0; i < grid_cols * grid_rows; i++) {
+        total += weights[i];
+      }
+    }
+
+    double cumulated = 0.0;
+    start[axis][0] = 0;
+    for (int c = 1; c <= n[axis]; c++) {
+      if (!(total > 0.0)) {
+        start[axis][c] = (c == n[axis]) ? size[axis] : c * (size[axis] / n[axis]);
+        continue;
+      }
+
+      for (int other = 0; other < n[1 - axis]; other++) {
+        cumulated += axis == 0 ? weights[other * grid_cols + c - 1]
+                               : weights[(c - 1) * grid_cols + other];
+      }
+      int at = (int)(size[axis] * (cumulated / total));
+      if (at < start[axis][c - 1] + min_block)
+        at = start[axis][c - 1] + min_block;
+      if (at > size[axis] - (n[axis] - c) * min_block)
+        at = size[axis] - (n[axis] - c) * min_block;
+      start[axis][c] = (c == n[axis]) ? size[axis] : at;
+    }
+  }
+}
+
+// Split a frame into the k_regions blocks of split_grid, sized by
+// split_bounds, each with up to ghost_width halo rows and columns on the
+// sides it shares with another block. Every block is at least ghost_width
+// pixels across each cut, so a halo never reaches past its neighbour; the
+// frame must have such a grid (see filter_chain_split_fits). The regions are
+// views into p.
 static inline Region *Split(pixel *p, int image_id, int image_width,
-                            int image_height, int k_regions) {
+                            int image_height, int k_regions, int ghost_width,
+                            const double *weights) {
   if (!p || k_regions == 0) {
     abort();
   }
 
-  // Calculate base dimensions for each region (without borders)
-  int region_width = image_width / k_regions;
-  assert(region_width > 0);
-  int region_height = image_height;
+  int grid_cols, grid_rows;
+  if (!split_grid(image_width, image_height, k_regions, ghost_width,
+                  &grid_cols, &grid_rows)) {
+    abort();
+  }
 
+  int *col_start = (int *)malloc((grid_cols + grid_rows + 2) * sizeof(int));
   Region *regions = (Region *)malloc(k_regions * sizeof(Region));
-  if (!regions) {
+  if (!col_start || !regions) {
     abort();
   }
+  int *row_start = col_start + grid_cols + 1;
+  split_bounds(image_width, image_height, grid_cols, grid_rows, weights,
+               ghost_width > 1 ? ghost_width : 1, col_start, row_start);
 
-  for (size_t region = 0; region < k_regions; region++) {
-    // Calculate region boundaries (x-axis, without borders)
-    int start_x = region * region_width;
-    int end_x =
-        (region == k_regions - 1) ? image_width : start_x + region_width;
+  for (int region = 0; region < k_regions; region++) {
+    int grid_x = region % grid_cols;
+    int grid_y = region / grid_cols;
 
-    // Add 5-pixel border for blur filter
-    int border_start_x = (start_x > 0) ? start_x - 5 : 0;
-    int border_end_x = (end_x < image_width) ? end_x + 5 : image_width;
+    // Calculate region boundaries (without borders)
+    int start_x = col_start[grid_x];
+    int end_x = col_start[grid_x + 1];
+    int start_y = row_start[grid_y];
+    int end_y = row_start[grid_y + 1];
 
-    int bordered_width = border_end_x - border_start_x;
+    // Add ghost_width-pixel border for blur filter
+    int border_start_x = (start_x > 0) ? start_x - ghost_width : 0;
+    int border_end_x =
+        (end_x < image_width) ? end_x + ghost_width : image_width;
+    int border_start_y = (start_y > 0) ? start_y - ghost_width : 0;
+    int border_end_y =
+        (end_y < image_height) ? end_y + ghost_width : image_height;
+    assert(border_start_x >= 0 && border_end_x <= image_width);
+    assert(border_start_y >= 0 && border_end_y <= image_height);
 
     regions[region].region_id = region;
     regions[region].image_id = image_id;
-    regions[region].region_width = bordered_width;
-    regions[region].region_height = image_height;
+    regions[region].region_width = border_end_x - border_start_x;
+    regions[region].region_height = border_end_y - border_start_y;
     regions[region].k_regions = k_regions;
-
-    regions[region].p =
-        (pixel *)malloc(bordered_width * image_height * sizeof(pixel));
-    if (!regions[region].p) {
-      abort();
-    }
-
-    // Copy pixel data with borders
-    for (int y = 0; y < image_height; y++) {
-      for (int x = 0; x < bordered_width; x++) {
-        int src_x = border_start_x + x;
-        int src_y = y;
-        int src_idx = src_y * image_width + src_x;
-        int dst_idx = y * bordered_width + x;
-
-        regions[region].p[dst_idx] = p[src_idx];
-      }
-    }
+    regions[region].ghost_width = ghost_width;
+    regions[region].grid_cols = grid_cols;
+    regions[region].grid_rows = grid_rows;
+    regions[region].x_offset = border_start_x;
+    regions[region].y_offset = border_start_y;
+    regions[region].frame_height = image_height;
+    regions[region].p = &p[CONV(border_start_y, border_start_x, image_width)];
+    regions[region].stride = image_width;
   }
 
+  free(col_start);
   return regions;
 }
 
-// Combines k Regions back into a single image
-static inline pixel *Combine(Region *regions, int image_width, int image_height,
-                             int k_regions) {
-  if (!regions || k_regions == 0) {
+// Copy the block each of the k regions owns back into frame p. Views into p
+// already hold their results there; only regions whose pixels are elsewhere
+// (received from other ranks) are copied.
+static inline void Combine(Region *regions, pixel *p, int image_width,
+                           int k_regions) {
+  if (!regions || !p || k_regions == 0) {
     abort();
   }
 
-  pixel *result = (pixel *)malloc(image_width * image_height * sizeof(pixel));
-  if (!result) {
-    abort();
-  }
-
-  // Calculate base region width (without borders)
-  int base_region_width = image_width / k_regions;
-
   for (int i = 0; i < k_regions; i++) {
     Region *region = &regions[i];
-    int region_id = region->region_id;
-
-    // Calculate original region boundaries (without borders)
-    int start_x = region_id * base_region_width;
-    int end_x = (region_id == k_regions - 1) ? image_width
-                                             : start_x + base_region_width;
-    int start_y = 0;
-    int end_y = image_height;
-
-    // Calculate border offset (5 pixels were added in Split)
-    int border_offset_x = (start_x > 0) ? 5 : 0;
-    int border_offset_y = 0; // No vertical borders for column splitting
-
-    // Copy pixel data back (excluding borders)
-    for (int y = start_y; y < end_y; y++) {
-      for (int x = start_x; x < end_x; x++) {
-        int src_x = x - start_x + border_offset_x;
-        int src_y = y - start_y + border_offset_y;
-        int src_idx = src_y * region->region_width + src_x;
-        int dst_idx = y * image_width + x;
-
-        result[dst_idx] = region->p[src_idx];
-      }
+    if (region->p ==
+        &p[CONV(region->y_offset, region->x_offset, image_width)]) {
+      continue;
     }
-  }
 
-  return result;
+    // Own block, without the halo added in Split
+    int ghost = region->ghost_width;
+    int x0 = region_has_left(region) ? ghost : 0;
+    int x1 = region->region_width - (region_has_right(region) ? ghost : 0);
+    int y0 = region_has_top(region) ? ghost : 0;
+    int y1 = region->region_height - (region_has_bottom(region) ? ghost : 0);
+
+    copy_rows(&p[CONV(region->y_offset + y0, region->x_offset + x0,
+                      image_width)],
+              image_width, &region->p[CONV(y0, x0, region->stride)],
+              region->stride, x1 - x0, y1 - y0);
+  }
 }
 
 #endif
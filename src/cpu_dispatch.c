@@ -0,0 +1,74 @@
+#include "cpu_dispatch.h"
+#include <string.h>
+
+static int active_isa = -1;
+
+int kernel_isa_supported(kernel_isa_t isa) {
+  switch (isa) {
+  case KERNEL_ISA_GENERIC:
+    return 1;
+#if KERNEL_ISA_X86
+  case KERNEL_ISA_AVX2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  case KERNEL_ISA_AVX512:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("avx512vl") &&
+           __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return 0;
+  }
+}
+
+kernel_isa_t kernel_isa_best(void) {
+  for (int isa = KERNEL_ISA_COUNT - 1; isa > KERNEL_ISA_GENERIC; isa--) {
+    if (kernel_isa_supported((kernel_isa_t)isa)) {
+      return (kernel_isa_t)isa;
+    }
+  }
+  return KERNEL_ISA_GENERIC;
+}
+
+kernel_isa_t kernel_isa(void) {
+  if (active_isa < 0) {
+    active_isa = kernel_isa_best();
+  }
+  return (kernel_isa_t)active_isa;
+}
+
+int kernel_isa_select(kernel_isa_t isa) {
+  if (isa < 0 || isa >= KERNEL_ISA_COUNT || !kernel_isa_supported(isa)) {
+    return 0;
+  }
+  active_isa = isa;
+  return 1;
+}
+
+const char *kernel_isa_name(kernel_isa_t isa) {
+  switch (isa) {
+  case KERNEL_ISA_AVX2:
+    return "avx2";
+  case KERNEL_ISA_AVX512:
+    return "avx512";
+  case KERNEL_ISA_GENERIC:
+  default:
+    return "generic";
+  }
+}
+
+int kernel_isa_parse(const char *name, kernel_isa_t *isa) {
+  if (strcmp(name, "auto") == 0) {
+    *isa = kernel_isa_best();
+    return 1;
+  }
+  for (int i = 0; i < KERNEL_ISA_COUNT; i++) {
+    if (strcmp(name, kernel_isa_name((kernel_isa_t)i)) == 0) {
+      *isa = (kernel_isa_t)i;
+      return 1;
+    }
+  }
+  return 0;
+}
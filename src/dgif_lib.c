@@ -22,6 +22,7 @@ two modules will be linked.  Preserve this property!
 
 #include "gif_lib.h"
 #include "gif_lib_private.h"
+#include "cpu_dispatch.h"
 
 /* compose unsigned little endian value */
 #define UNSIGNED_LITTLE_ENDIAN(lo, hi)	((lo) | ((hi) << 8))
@@ -798,8 +799,8 @@ DGifSetupDecompress(GifFileType *GifFile)
  This routine can be called few times (one per scan line, for example), in
  order the complete the whole image.
 ******************************************************************************/
-static int
-DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line, int LineLen)
+static inline KERNEL_ALWAYS_INLINE int
+DGifDecompressLine_body(GifFileType *GifFile, GifPixelType *Line, int LineLen)
 {
     int i = 0;
     int j, CrntCode, EOFCode, ClearCode, CrntPrefix, LastCode, StackPtr;
@@ -921,6 +922,17 @@ DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line, int LineLen)
     return GIF_OK;
 }
 
+/* One build of the decoder per instruction set, see cpu_dispatch.h */
+KERNEL_DEFINE_VARIANTS(int, DGifDecompressLine,
+                       (GifFileType *GifFile, GifPixelType *Line, int LineLen),
+                       (GifFile, Line, LineLen))
+
+static int
+DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line, int LineLen)
+{
+    return DGifDecompressLine_select()(GifFile, Line, LineLen);
+}
+
 /******************************************************************************
  Routine to trace the Prefixes linked list until we get a prefix which is
  not code, but a pixel value (less than ClearCode). Returns that pixel value.
@@ -24,6 +24,7 @@ two modules will be linked.  Preserve this property!
 
 #include "gif_lib.h"
 #include "gif_lib_private.h"
+#include "cpu_dispatch.h"
 
 /* Masks given codes to BitsPerPixel, to make sure all codes are in range: */
 /*@+charint@*/
@@ -875,10 +876,10 @@ EGifSetupCompress(GifFileType *GifFile)
  This routine can be called a few times (one per scan line, for example), in
  order to complete the whole image.
 ******************************************************************************/
-static int
-EGifCompressLine(GifFileType *GifFile,
-                 GifPixelType *Line,
-                 const int LineLen)
+static inline KERNEL_ALWAYS_INLINE int
+EGifCompressLine_body(GifFileType *GifFile,
+                      GifPixelType *Line,
+                      const int LineLen)
 {
     int i = 0, CrntCode, NewCode;
     unsigned long NewKey;
@@ -958,6 +959,20 @@ EGifCompressLine(GifFileType *GifFile,
     return GIF_OK;
 }
 
+/* One build of the encoder per instruction set, see cpu_dispatch.h */
+KERNEL_DEFINE_VARIANTS(int, EGifCompressLine,
+                       (GifFileType *GifFile, GifPixelType *Line,
+                        const int LineLen),
+                       (GifFile, Line, LineLen))
+
+static int
+EGifCompressLine(GifFileType *GifFile,
+                 GifPixelType *Line,
+                 const int LineLen)
+{
+    return EGifCompressLine_select()(GifFile, Line, LineLen);
+}
+
 /******************************************************************************
  The LZ compression output routine:
  This routine is responsible for the compression of the bit stream into
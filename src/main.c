@@ -6,9 +6,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include <sys/time.h>
 
 #include "gif_lib.h"
+#include "filter_chain.h"
 
 /* Set this macro to 1 to enable debugging information */
 #define SOBELF_DEBUG 0
@@ -769,7 +771,7 @@ apply_blur_filter( animated_gif * image, int size, int threshold )
 }
 
 void
-apply_sobel_filter( animated_gif * image )
+apply_sobel_filter( animated_gif * image, int threshold )
 {
     int i, j, k ;
     int width, height ;
@@ -816,7 +818,7 @@ apply_sobel_filter( animated_gif * image )
                 val_blue = sqrt(deltaX_blue * deltaX_blue + deltaY_blue * deltaY_blue)/4;
 
 
-                if ( val_blue > 50 )
+                if ( val_blue > threshold )
                 {
                     sobel[CONV(j  ,k  ,width)].r = 255 ;
                     sobel[CONV(j  ,k  ,width)].g = 255 ;
@@ -853,19 +855,45 @@ main( int argc, char ** argv )
 {
     char * input_filename ;
     char * output_filename ;
+    char * chain_spec = NULL ;
+    char * chain_file = NULL ;
     animated_gif * image ;
+    filter_chain_t chain ;
     struct timeval t1, t2;
     double duration ;
+    int arg = 1 ;
+    int s ;
+
+    /* Optional filter chain (default: gray, blur 5/20, sobel 50) */
+    while ( arg + 1 < argc && argv[arg][0] == '-' )
+    {
+        if ( strcmp( argv[arg], "--chain" ) == 0 ) chain_spec = argv[arg+1] ;
+        else if ( strcmp( argv[arg], "--chain-file" ) == 0 ) chain_file = argv[arg+1] ;
+        else break ;
+        arg += 2 ;
+    }
 
     /* Check command-line arguments */
-    if ( argc < 3 )
+    if ( argc - arg != 2 || ( chain_spec && chain_file ) )
     {
-        fprintf( stderr, "Usage: %s input.gif output.gif \n", argv[0] ) ;
+        fprintf( stderr, "Usage: %s [--chain STAGES | --chain-file FILE] "
+                "input.gif output.gif \n", argv[0] ) ;
         return 1 ;
     }
 
-    input_filename = argv[1] ;
-    output_filename = argv[2] ;
+    input_filename = argv[arg] ;
+    output_filename = argv[arg+1] ;
+
+    if ( chain_file )
+    {
+        if ( !filter_chain_load( chain_file, &chain ) ) { return 1 ; }
+    }
+    else if ( !filter_chain_parse( chain_spec ? chain_spec : FILTER_CHAIN_DEFAULT,
+                                   &chain ) )
+    {
+        return 1 ;
+    }
+    filter_chain_plan( &chain ) ;
 
     /* IMPORT Timer start */
     gettimeofday(&t1, NULL);
@@ -885,14 +913,26 @@ main( int argc, char ** argv )
     /* FILTER Timer start */
     gettimeofday(&t1, NULL);
 
-    /* Convert the pixels into grayscale */
-    apply_gray_filter( image ) ;
-
-    /* Apply blur filter with convergence value */
-    apply_blur_filter( image, 5, 20 ) ;
-
-    /* Apply sobel filter on pixels */
-    apply_sobel_filter( image ) ;
+    /* Apply each stage of the filter chain to all images */
+    for ( s = 0 ; s < chain.n_stages ; s++ )
+    {
+        switch ( chain.stages[s].kind )
+        {
+            case FILTER_STAGE_GRAY:
+                /* Convert the pixels into grayscale */
+                apply_gray_filter( image ) ;
+                break ;
+            case FILTER_STAGE_BLUR:
+                /* Apply blur filter with convergence value */
+                apply_blur_filter( image, chain.stages[s].radius,
+                        chain.stages[s].threshold ) ;
+                break ;
+            case FILTER_STAGE_SOBEL:
+                /* Apply sobel filter on pixels */
+                apply_sobel_filter( image, chain.stages[s].threshold ) ;
+                break ;
+        }
+    }
 
     /* FILTER Timer stop */
     gettimeofday(&t2, NULL);
@@ -1,8 +1,28 @@
+#include "cpu_dispatch.h"
 #include "gif_lib.h"
 #include "gif_model.h"
 #include <stdio.h>
 #include <stdlib.h>
 
+/* Expand color indices into pixels through the color map */
+static inline KERNEL_ALWAYS_INLINE void
+palette_expand_body(const GifByteType *bits, const GifColorType *colors,
+                    pixel *out, int n_pixels) {
+  for (int j = 0; j < n_pixels; j++) {
+    GifColorType c = colors[bits[j]];
+
+    out[j].r = c.Red;
+    out[j].g = c.Green;
+    out[j].b = c.Blue;
+  }
+}
+
+KERNEL_DEFINE_VOID_VARIANTS(palette_expand,
+                            (const GifByteType *bits,
+                             const GifColorType *colors, pixel *out,
+                             int n_pixels),
+                            (bits, colors, out, n_pixels))
+
 animated_gif *load_pixels(char *filename) {
   GifFileType *g;
   ColorMapObject *colmap;
@@ -92,8 +112,6 @@ animated_gif *load_pixels(char *filename) {
 
   /* For each image */
   for (i = 0; i < n_images; i++) {
-    int j;
-
     /* Get the local colormap if needed */
     if (g->SavedImages[i].ImageDesc.ColorMap) {
 
@@ -105,15 +123,8 @@ animated_gif *load_pixels(char *filename) {
     }
 
     /* Traverse the image and fill pixels */
-    for (j = 0; j < width[i] * height[i]; j++) {
-      int c;
-
-      c = g->SavedImages[i].RasterBits[j];
-
-      p[i][j].r = colmap->Colors[c].Red;
-      p[i][j].g = colmap->Colors[c].Green;
-      p[i][j].b = colmap->Colors[c].Blue;
-    }
+    palette_expand_select()(g->SavedImages[i].RasterBits, colmap->Colors, p[i],
+                            width[i] * height[i]);
   }
 
   /* Allocate image info */
@@ -1,7 +1,41 @@
+#include "cpu_dispatch.h"
 #include "gif_model.h"
+#include "persist_api.h"
 #include <stdio.h>
 #include <stdlib.h>
 
+/* Look up pixels in a color map, in order, stopping at the first pixel that
+ * is not in it. The index of each pixel (the last matching entry, as the map
+ * may contain duplicates) is stored in index unless it is NULL. Returns the
+ * number of pixels found. */
+static inline KERNEL_ALWAYS_INLINE int
+colormap_lookup_body(const pixel *p, int n_pixels, const GifColorType *colors,
+                     int n_colors, GifByteType *index) {
+  for (int j = 0; j < n_pixels; j++) {
+    int found = -1;
+    for (int k = 0; k < n_colors; k++) {
+      if (p[j].r == colors[k].Red && p[j].g == colors[k].Green &&
+          p[j].b == colors[k].Blue) {
+        found = k;
+      }
+    }
+
+    if (found == -1) {
+      return j;
+    }
+    if (index) {
+      index[j] = found;
+    }
+  }
+  return n_pixels;
+}
+
+KERNEL_DEFINE_VARIANTS(int, colormap_lookup,
+                       (const pixel *p, int n_pixels,
+                        const GifColorType *colors, int n_colors,
+                        GifByteType *index),
+                       (p, n_pixels, colors, n_colors, index))
+
 int output_modified_read_gif(char *filename, GifFileType *g) {
   GifFileType *g2;
   int error2;
@@ -37,17 +71,30 @@ int output_modified_read_gif(char *filename, GifFileType *g) {
   return 1;
 }
 
-int store_pixels(char *filename, animated_gif *image) {
+/* Output color map of an animated GIF being stored. Colors are appended in
+ * the order they are first met, frame after frame, so each frame can be
+ * indexed as soon as every frame before it has been. */
+struct gif_store {
+  GifColorType *colormap;
+  int n_colors;
+  int next_frame;
+  colormap_lookup_fn lookup;
+};
+
+gif_store *store_begin(animated_gif *image) {
   int n_colors = 0;
-  pixel **p;
   int i, j, k;
   GifColorType *colormap;
+  gif_store *store;
 
   /* Initialize the new set of colors */
   colormap = (GifColorType *)malloc(256 * sizeof(GifColorType));
-  if (colormap == NULL) {
+  store = (gif_store *)malloc(sizeof(gif_store));
+  if (colormap == NULL || store == NULL) {
     fprintf(stderr, "Unable to allocate 256 colors\n");
-    return 0;
+    free(colormap);
+    free(store);
+    return NULL;
   }
 
   /* Everything is white by default */
@@ -121,7 +168,9 @@ int store_pixels(char *filename, animated_gif *image) {
         if (found == -1) {
           if (n_colors >= 256) {
             fprintf(stderr, "Error: Found too many colors inside the image\n");
-            return 0;
+            free(colormap);
+            free(store);
+            return NULL;
           }
 
 #if SOBELF_DEBUG
@@ -184,7 +233,9 @@ int store_pixels(char *filename, animated_gif *image) {
             if (n_colors >= 256) {
               fprintf(stderr,
                       "Error: Found too many colors inside the image\n");
-              return 0;
+              free(colormap);
+              free(store);
+              return NULL;
             }
 
 #if SOBELF_DEBUG
@@ -214,89 +265,115 @@ int store_pixels(char *filename, animated_gif *image) {
          n_colors);
 #endif
 
-  p = image->p;
+  store->colormap = colormap;
+  store->n_colors = n_colors;
+  store->next_frame = 0;
+  store->lookup = colormap_lookup_select();
+  return store;
+}
 
-  /* Find the number of colors inside the image */
-  for (i = 0; i < image->n_images; i++) {
+int store_frame(gif_store *store, animated_gif *image) {
+  int i = store->next_frame++;
+  pixel *p = image->p[i];
+  int n_pixels = image->width[i] * image->height[i];
+  int j;
 
 #if SOBELF_DEBUG
-    printf("OUTPUT: Processing image %d (total of %d images) -> %d x %d\n", i,
-           image->n_images, image->width[i], image->height[i]);
+  printf("OUTPUT: Processing image %d (total of %d images) -> %d x %d\n", i,
+         image->n_images, image->width[i], image->height[i]);
 #endif
 
-    for (j = 0; j < image->width[i] * image->height[i]; j++) {
-      int found = 0;
-      for (k = 0; k < n_colors; k++) {
-        if (p[i][j].r == colormap[k].Red && p[i][j].g == colormap[k].Green &&
-            p[i][j].b == colormap[k].Blue) {
-          found = 1;
-        }
-      }
-
-      if (found == 0) {
-        if (n_colors >= 256) {
-          fprintf(stderr, "Error: Found too many colors inside the image\n");
-          return 0;
-        }
+  /* Add the colors first met in this frame */
+  j = 0;
+  while ((j += store->lookup(p + j, n_pixels - j, store->colormap,
+                             store->n_colors, NULL)) < n_pixels) {
+    if (store->n_colors >= 256) {
+      fprintf(stderr, "Error: Found too many colors inside the image\n");
+      return 0;
+    }
 
 #if SOBELF_DEBUG
-        printf("[DEBUG] Found new %d color (%d,%d,%d)\n", n_colors, p[i][j].r,
-               p[i][j].g, p[i][j].b);
+    printf("[DEBUG] Found new %d color (%d,%d,%d)\n", store->n_colors, p[j].r,
+           p[j].g, p[j].b);
 #endif
 
-        colormap[n_colors].Red = p[i][j].r;
-        colormap[n_colors].Green = p[i][j].g;
-        colormap[n_colors].Blue = p[i][j].b;
-        n_colors++;
-      }
-    }
+    store->colormap[store->n_colors].Red = p[j].r;
+    store->colormap[store->n_colors].Green = p[j].g;
+    store->colormap[store->n_colors].Blue = p[j].b;
+    store->n_colors++;
+  }
+
+  /* Colors found so far are all distinct and keep their index, so the
+   * frame can be indexed right away (see store_end for the padding) */
+  if (store->lookup(p, n_pixels, store->colormap, store->n_colors,
+                    image->g->SavedImages[i].RasterBits) < n_pixels) {
+    fprintf(stderr, "Error: Unable to find a pixel in the color map\n");
+    return 0;
   }
 
+  return 1;
+}
+
+void store_abort(gif_store *store) {
+  free(store->colormap);
+  free(store);
+}
+
+int store_end(gif_store *store, char *filename, animated_gif *image) {
+  int n_colors = store->n_colors;
+  GifColorType *colormap = store->colormap;
+  int i, j;
+
+  free(store);
+
 #if SOBELF_DEBUG
   printf("OUTPUT: found %d color(s)\n", n_colors);
 #endif
 
   /* Round up to a power of 2 */
-  if (n_colors != (1 << GifBitSize(n_colors))) {
-    n_colors = (1 << GifBitSize(n_colors));
+  int n_padded = n_colors;
+  if (n_padded != (1 << GifBitSize(n_padded))) {
+    n_padded = (1 << GifBitSize(n_padded));
   }
 
 #if SOBELF_DEBUG
-  printf("OUTPUT: Rounding up to %d color(s)\n", n_colors);
+  printf("OUTPUT: Rounding up to %d color(s)\n", n_padded);
 #endif
 
   /* Change the color map inside the animated gif */
   ColorMapObject *cmo;
 
-  cmo = GifMakeMapObject(n_colors, colormap);
+  cmo = GifMakeMapObject(n_padded, colormap);
   if (cmo == NULL) {
     fprintf(stderr, "Error while creating a ColorMapObject w/ %d color(s)\n",
-            n_colors);
+            n_padded);
+    free(colormap);
     return 0;
   }
 
-  image->g->SColorMap = cmo;
-
-  /* Update the raster bits according to color map */
-  for (i = 0; i < image->n_images; i++) {
-    for (j = 0; j < image->width[i] * image->height[i]; j++) {
-      int found_index = -1;
-      for (k = 0; k < n_colors; k++) {
-        if (p[i][j].r == image->g->SColorMap->Colors[k].Red &&
-            p[i][j].g == image->g->SColorMap->Colors[k].Green &&
-            p[i][j].b == image->g->SColorMap->Colors[k].Blue) {
-          found_index = k;
-        }
+  /* The padding entries are white, and a pixel maps to the last entry of
+   * its color: white pixels move to the last padding entry */
+  if (n_padded > n_colors) {
+    int white = -1;
+    for (j = 0; j < n_colors; j++) {
+      if (colormap[j].Red == 255 && colormap[j].Green == 255 &&
+          colormap[j].Blue == 255) {
+        white = j;
       }
-
-      if (found_index == -1) {
-        fprintf(stderr, "Error: Unable to find a pixel in the color map\n");
-        return 0;
+    }
+    for (i = 0; white >= 0 && i < image->n_images; i++) {
+      GifByteType *bits = image->g->SavedImages[i].RasterBits;
+      int n_pixels = image->width[i] * image->height[i];
+      for (j = 0; j < n_pixels; j++) {
+        if (bits[j] == white) {
+          bits[j] = n_padded - 1;
+        }
       }
-
-      image->g->SavedImages[i].RasterBits[j] = found_index;
     }
   }
+  free(colormap);
+
+  image->g->SColorMap = cmo;
 
   /* Write the final image */
   if (!output_modified_read_gif(filename, image->g)) {
@@ -305,3 +382,19 @@ int store_pixels(char *filename, animated_gif *image) {
 
   return 1;
 }
+
+int store_pixels(char *filename, animated_gif *image) {
+  gif_store *store = store_begin(image);
+  if (store == NULL) {
+    return 0;
+  }
+
+  for (int i = 0; i < image->n_images; i++) {
+    if (!store_frame(store, image)) {
+      store_abort(store);
+      return 0;
+    }
+  }
+
+  return store_end(store, filename, image);
+}
@@ -1,9 +1,14 @@
 #include "gif_model.h"
+#include "mpi_protocol.h"
 #include "persist_api.h"
+#include "rank_balance.h"
 #include "region_filter.h"
+#include "region_message.h"
 #include "runtime_config.h"
+#include "shared_frames.h"
 
 #include "split.h"
+#include <limits.h>
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,18 +17,6 @@
 
 #include "sobel_cuda.h"
 
-#define TAG_COMMAND 0
-#define TAG_REGION_COUNT 1
-#define TAG_BUFFER_SIZE 2
-#define TAG_BUFFER_DATA 3
-#define TAG_RESULT_SIZE 4
-#define TAG_RESULT_DATA 5
-
-// Master -> Workers
-#define CMD_PROCESS_SPLIT_IMAGE 1
-#define CMD_PROCESS_BATCH 2
-#define CMD_TERMINATE 3
-
 #define MPI_TOTAL_THRESHOLD 60000
 #define MPI_OPENMP_THRESHOLD 1300000
 #define MPI_SPLIT_THRESHOLD 550
@@ -31,218 +24,511 @@
 // Global flag for GPU availability, set once at startup
 static int g_use_gpu = 0;
 
-static int compare_regions(const void *a, const void *b) {
-  const Region *ra = (const Region *)a;
-  const Region *rb = (const Region *)b;
-  if (ra->image_id != rb->image_id) {
-    return ra->image_id - rb->image_id;
+// Measured throughput of every rank (pixels per second), NULL when work is
+// shared out equally
+static double *g_rank_speed = NULL;
+
+// Frames shared with the ranks of this node (see shared_frames.h), and which
+// ranks map them (NULL when frames are only sent in messages)
+static shared_frames g_shared = {.node = MPI_COMM_NULL};
+static char *g_node_local = NULL;
+
+// Output being prepared while frames are still filtered: results are put
+// back into their frame as they arrive, and frames are handed to the GIF
+// store in order as soon as every frame before them is final
+typedef struct {
+  animated_gif *image;
+  gif_store *store;
+  char *done;     // Frames whose filtered pixels are in image->p
+  int next;       // First frame not handed to the store yet
+  int ok;         // 0 once the store has failed
+} frame_stream_t;
+
+// Record that frame image_id is final and hand every frame now ready to the
+// store
+static void stream_frame_done(frame_stream_t *stream, int image_id) {
+  stream->done[image_id] = 1;
+  while (stream->ok && stream->next < stream->image->n_images &&
+         stream->done[stream->next]) {
+    stream->ok = store_frame(stream->store, stream->image);
+    stream->next++;
   }
-  return ra->region_id - rb->region_id;
 }
 
-static int calculate_batch_buffer_size(Region *regions, int count) {
-  int total_size = 0;
-  for (int i = 0; i < count; i++) {
-    total_size += 5 * sizeof(int); // metadata
-    total_size +=
-        regions[i].region_width * regions[i].region_height * sizeof(pixel);
+// Copy the k regions of a frame received from workers back into it and
+// record the frame as final
+static void stream_regions(frame_stream_t *stream, Region *regions, int k) {
+  int i = regions[0].image_id;
+  animated_gif *image = stream->image;
+  Combine(regions, image->p[i], image->width[i], k);
+  stream_frame_done(stream, i);
+}
+
+// Apply the filter chain to a batch of unsplit regions with GPU dispatch for
+// all filters if available
+static void apply_filters_batch_with_gpu_dispatch(Region *regions, int count,
+                                                  runtime_config_t config) {
+  apply_filter_chain_to_regions_gpu(regions, count, g_use_gpu, config);
+}
+
+// Message on its way to a worker. Sends are non-blocking, so the message
+// stays here until its transfer completes.
+typedef struct {
+  int first;      // First frame of the chunk in the work queue
+  char *buffer;
+  MPI_Request request;
+} outbound_t;
+
+// Wait for the previous send to a worker and release its message
+static void outbound_complete(outbound_t *out) {
+  if (out->buffer) {
+    MPI_Wait(&out->request, MPI_STATUS_IGNORE);
+    free(out->buffer);
+    out->buffer = NULL;
   }
-  return total_size;
 }
 
-// Pack a batch of regions into a single buffer
-static void pack_regions(Region *regions, int count, char *buffer,
-                         int buffer_size, MPI_Comm comm) {
-  int position = 0;
-  for (int i = 0; i < count; i++) {
-    int metadata[5] = {regions[i].image_id, regions[i].region_id,
-                       regions[i].region_width, regions[i].region_height,
-                       regions[i].k_regions};
-    MPI_Pack(metadata, 5, MPI_INT, buffer, buffer_size, &position, comm);
+// Start sending count regions to worker w in one message tagged cmd
+static void outbound_start(outbound_t *out, Region *regions, int count,
+                           int cmd, int w) {
+  outbound_complete(out);
+  int size = region_message_size(regions, count);
+  out->buffer = (char *)malloc(size);
+  region_message_write(out->buffer, regions, count, 0.0);
+  MPI_Isend(out->buffer, size, MPI_BYTE, w, cmd, MPI_COMM_WORLD,
+            &out->request);
+}
 
-    int pixel_count = regions[i].region_width * regions[i].region_height;
-    MPI_Pack(regions[i].p, pixel_count * sizeof(pixel), MPI_BYTE, buffer,
-             buffer_size, &position, comm);
+// Start sending worker w, which maps the shared frames, the indices of count
+// frames to filter in place
+static void outbound_start_shared(outbound_t *out, Region *frames, int count,
+                                  int w) {
+  outbound_complete(out);
+  message_header header = {count, 0.0};
+  int size = sizeof(header) + count * sizeof(int);
+  out->buffer = (char *)malloc(size);
+  memcpy(out->buffer, &header, sizeof(header));
+  int *ids = (int *)(out->buffer + sizeof(header));
+  for (int r = 0; r < count; r++) {
+    ids[r] = frames[r].image_id;
   }
+  MPI_Isend(out->buffer, size, MPI_BYTE, w, CMD_PROCESS_CHUNK, MPI_COMM_WORLD,
+            &out->request);
 }
 
-// Unpack a batch of regions from a single buffer
-static void unpack_regions(Region *regions, int count, char *buffer,
-                           int buffer_size, MPI_Comm comm) {
-  int position = 0;
-  for (int i = 0; i < count; i++) {
-    int metadata[5];
-    MPI_Unpack(buffer, buffer_size, &position, metadata, 5, MPI_INT, comm);
+// Send cmd, which carries no data, to every worker
+static void send_command(int cmd, int world_size) {
+  for (int w = 1; w < world_size; w++) {
+    MPI_Send(NULL, 0, MPI_BYTE, w, cmd, MPI_COMM_WORLD);
+  }
+}
 
-    regions[i].image_id = metadata[0];
-    regions[i].region_id = metadata[1];
-    regions[i].region_width = metadata[2];
-    regions[i].region_height = metadata[3];
-    regions[i].k_regions = metadata[4];
+// Move the frames into an arena shared with the ranks of this node, if any
+// (see shared_frames.h)
+static void share_frames(animated_gif *image, int world_size) {
+  send_command(CMD_SHARE_FRAMES, world_size);
 
-    int pixel_count = regions[i].region_width * regions[i].region_height;
-    regions[i].p = (pixel *)malloc(pixel_count * sizeof(pixel));
+  MPI_Comm node = shared_frames_node(MPI_COMM_WORLD);
+  if (node == MPI_COMM_NULL) {
+    printf("Shared frames: no other rank on this node\n");
+    return;
+  }
+  shared_frames_create(&g_shared, node, image);
+
+  int node_size;
+  MPI_Group node_group, world_group;
+  MPI_Comm_size(node, &node_size);
+  MPI_Comm_group(node, &node_group);
+  MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+  int *node_ranks = (int *)malloc(node_size * sizeof(int));
+  int *world_ranks = (int *)malloc(node_size * sizeof(int));
+  for (int r = 0; r < node_size; r++) {
+    node_ranks[r] = r;
+  }
+  MPI_Group_translate_ranks(node_group, node_size, node_ranks, world_group,
+                            world_ranks);
 
-    MPI_Unpack(buffer, buffer_size, &position, regions[i].p,
-               pixel_count * sizeof(pixel), MPI_BYTE, comm);
+  g_node_local = (char *)calloc(world_size, 1);
+  for (int r = 0; r < node_size; r++) {
+    g_node_local[world_ranks[r]] = 1;
   }
+  printf("Shared frames: %d rank(s) on this node\n", node_size);
+
+  free(world_ranks);
+  free(node_ranks);
+  MPI_Group_free(&world_group);
+  MPI_Group_free(&node_group);
 }
 
-// Apply filters with GPU dispatch for all filters if available
-static void apply_filters_with_gpu_dispatch(Region *region, int blur_size,
-                                            int blur_threshold, runtime_config_t config) {
-  apply_all_filters_to_region_gpu(region, blur_size, blur_threshold, g_use_gpu, config);
+// Ask every rank to measure its throughput (see rank_balance.h)
+static void calibrate_ranks(int world_size, runtime_config_t config) {
+  send_command(CMD_CALIBRATE, world_size);
+
+  g_rank_speed = (double *)malloc(world_size * sizeof(double));
+  double speed = balance_calibrate(&config.chain, config.openmp_mode);
+  MPI_Gather(&speed, 1, MPI_DOUBLE, g_rank_speed, 1, MPI_DOUBLE, 0,
+             MPI_COMM_WORLD);
+
+  printf("Rank throughput (Mpixel/s):");
+  for (int w = 0; w < world_size; w++) {
+    printf(" %.1f", g_rank_speed[w] / 1e6);
+  }
+  printf("\n");
 }
 
-// Apply filters with MPI sync and GPU dispatch for all filters if available
-static void apply_filters_mpi_with_gpu_dispatch(Region *region, int blur_size,
-                                                int blur_threshold,
-                                                MPI_Comm comm, runtime_config_t config) {
-  apply_all_filters_to_region_mpi_gpu(region, blur_size, blur_threshold, comm,
-                                      g_use_gpu, config);
+// Whether split image blocks go through MPI_Scatterv / MPI_Gatherv, whose
+// tree or pipelined algorithms spare rank 0 one transfer per worker
+static int use_collectives(int world_size, runtime_config_t config) {
+  switch (config.collective_mode) {
+  case COLLECTIVE_MODE_OFF:
+    return 0;
+  case COLLECTIVE_MODE_FORCE:
+    return 1;
+  case COLLECTIVE_MODE_AUTO:
+  default:
+    return world_size >= COLLECTIVE_MIN_RANKS;
+  }
 }
 
-static void process_split_image(animated_gif *image, int image_idx,
-                                int world_size, Region **result_regions, runtime_config_t config) {
-  Region *regions =
-      Split(image->p[image_idx], image_idx, image->width[image_idx],
-            image->height[image_idx], world_size);
+// Move the master's block into its slot of the split window, if there is one,
+// where the other ranks read its halo; stream_regions copies it back. Pairs
+// with split_block_slot on the workers.
+static void place_own_block(Region *region, runtime_config_t config) {
+  char *slot = split_block_slot(region_message_size(region, 1), config);
+  if (slot) {
+    region_message_write(slot, region, 1, 0.0);
+    message_header header;
+    Region *block = region_message_read(slot, &header);
+    *region = block[0];
+    free(block);
+  }
+}
 
-  int cmd = CMD_PROCESS_SPLIT_IMAGE;
+// Hand block w of regions to every worker w with one MPI_Scatterv of their
+// messages, preceded by an MPI_Scatter of their sizes. The master's own block
+// goes to its slot of the split window, if any.
+static void scatter_blocks(Region *regions, int world_size,
+                           runtime_config_t config) {
+  int *sizes = (int *)calloc(world_size, sizeof(int));
+  int *displs = (int *)calloc(world_size, sizeof(int));
+  int total = 0;
   for (int w = 1; w < world_size; w++) {
-    MPI_Send(&cmd, 1, MPI_INT, w, TAG_COMMAND, MPI_COMM_WORLD);
+    sizes[w] = region_message_size(&regions[w], 1);
+    displs[w] = total;
+    if (sizes[w] > INT_MAX - total) {
+      fprintf(stderr, "Master: Scattered blocks exceed %d bytes\n", INT_MAX);
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    total += sizes[w];
   }
 
+  char *buffer = (char *)malloc(total);
   for (int w = 1; w < world_size; w++) {
-    int buffer_size = calculate_batch_buffer_size(&regions[w], 1);
-    char *buffer = (char *)malloc(buffer_size);
-    pack_regions(&regions[w], 1, buffer, buffer_size, MPI_COMM_WORLD);
-
-    MPI_Send(&buffer_size, 1, MPI_INT, w, TAG_BUFFER_SIZE, MPI_COMM_WORLD);
-    MPI_Send(buffer, buffer_size, MPI_PACKED, w, TAG_BUFFER_DATA,
-             MPI_COMM_WORLD);
-
-    free(buffer);
-    free(regions[w].p);
+    region_message_write(buffer + displs[w], &regions[w], 1, 0.0);
   }
 
-  Region *master_region = &regions[0];
+  MPI_Scatter(sizes, 1, MPI_INT, MPI_IN_PLACE, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  place_own_block(&regions[0], config);
+  MPI_Scatterv(buffer, sizes, displs, MPI_BYTE, MPI_IN_PLACE, 0, MPI_BYTE, 0,
+               MPI_COMM_WORLD);
+
+  free(buffer);
+  free(displs);
+  free(sizes);
+}
 
-  apply_filters_mpi_with_gpu_dispatch(master_region, 5, 20, MPI_COMM_WORLD, config);
+// Collect the filtered block of every worker into regions, the inverse of
+// scatter_blocks. They are views into the returned buffer, to be freed once
+// they have been combined.
+static char *gather_blocks(Region *regions, int world_size) {
+  int *sizes = (int *)calloc(world_size, sizeof(int));
+  int *displs = (int *)calloc(world_size, sizeof(int));
+  MPI_Gather(MPI_IN_PLACE, 1, MPI_INT, sizes, 1, MPI_INT, 0, MPI_COMM_WORLD);
 
-  *result_regions = (Region *)malloc(world_size * sizeof(Region));
-  (*result_regions)[0] = *master_region;
+  int total = 0;
+  for (int w = 1; w < world_size; w++) {
+    displs[w] = total;
+    total += sizes[w];
+  }
 
+  char *buffer = (char *)malloc(total > 0 ? total : 1);
+  MPI_Gatherv(MPI_IN_PLACE, 0, MPI_BYTE, buffer, sizes, displs, MPI_BYTE, 0,
+              MPI_COMM_WORLD);
   for (int w = 1; w < world_size; w++) {
-    int buffer_size;
-    MPI_Recv(&buffer_size, 1, MPI_INT, w, TAG_RESULT_SIZE, MPI_COMM_WORLD,
-             MPI_STATUS_IGNORE);
+    message_header header;
+    Region *block = region_message_read(buffer + displs[w], &header);
+    regions[w] = block[0];
+    free(block);
+  }
 
-    char *buffer = (char *)malloc(buffer_size);
-    MPI_Recv(buffer, buffer_size, MPI_PACKED, w, TAG_RESULT_DATA,
-             MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  free(displs);
+  free(sizes);
+  return buffer;
+}
 
-    unpack_regions(&(*result_regions)[w], 1, buffer, buffer_size,
-                   MPI_COMM_WORLD);
-    free(buffer);
+// Blocks go out without waiting for each transfer: the master starts on its
+// own block right away. Results are views into the messages returned in
+// results[w], to be freed once they have been combined.
+static void process_split_blocks_p2p(Region *regions, int world_size,
+                                     char **results,
+                                     runtime_config_t config) {
+  outbound_t *out = (outbound_t *)calloc(world_size, sizeof(outbound_t));
+  for (int w = 1; w < world_size; w++) {
+    outbound_start(&out[w], &regions[w], 1, CMD_PROCESS_SPLIT_IMAGE, w);
+  }
+  place_own_block(&regions[0], config);
+
+  filter_split_region(&regions[0], g_use_gpu, config);
+
+  // Collect blocks in the order workers finish them
+  for (int n = 1; n < world_size; n++) {
+    MPI_Status status;
+    int size;
+    char *message = message_receive(MPI_ANY_SOURCE, TAG_RESULT,
+                                    MPI_COMM_WORLD, &status, &size);
+    int w = status.MPI_SOURCE;
+    message_header header;
+    Region *block = region_message_read(message, &header);
+    regions[w] = block[0];
+    results[w] = message;
+    free(block);
   }
 
-  free(regions);
+  for (int w = 1; w < world_size; w++) {
+    outbound_complete(&out[w]);
+  }
+  free(out);
 }
 
-static void process_nonsplit_images_batch(animated_gif *image,
-                                          int *image_indices, int num_images,
-                                          int world_size,
-                                          Region **result_regions,
-                                          int *result_count, runtime_config_t config) {
-  Region *all_regions = (Region *)malloc(num_images * sizeof(Region));
-  for (int i = 0; i < num_images; i++) {
-    int idx = image_indices[i];
-    Region *r =
-        Split(image->p[idx], idx, image->width[idx], image->height[idx], 1);
-    all_regions[i] = r[0];
-    free(r);
+static void process_split_image(animated_gif *image, int image_idx,
+                                int world_size, frame_stream_t *stream,
+                                runtime_config_t config) {
+  // Block r is filtered by rank r, so blocks are sized by rank speed
+  double *weights = NULL;
+  if (g_rank_speed) {
+    weights = (double *)malloc(world_size * sizeof(double));
+    balance_weights(g_rank_speed, world_size, weights);
   }
 
-  Region **worker_regions = (Region **)malloc(world_size * sizeof(Region *));
-  int *worker_counts = (int *)calloc(world_size, sizeof(int));
+  Region *regions =
+      Split(image->p[image_idx], image_idx, image->width[image_idx],
+            image->height[image_idx], world_size,
+            filter_chain_halo_width(&config.chain, image->width[image_idx],
+                                    image->height[image_idx], world_size,
+                                    weights),
+            weights);
+  free(weights);
+
+  // Messages holding the filtered blocks
+  char **results = (char **)calloc(world_size, sizeof(char *));
+  if (use_collectives(world_size, config)) {
+    scatter_blocks(regions, world_size, config);
+    filter_split_region(&regions[0], g_use_gpu, config);
+    results[0] = gather_blocks(regions, world_size);
+  } else {
+    process_split_blocks_p2p(regions, world_size, results, config);
+  }
+  stream_regions(stream, regions, world_size);
 
   for (int w = 0; w < world_size; w++) {
-    worker_regions[w] = (Region *)malloc(num_images * sizeof(Region));
+    free(results[w]);
   }
+  free(results);
+  free(regions);
+}
 
-  for (int i = 0; i < num_images; i++) {
-    int worker_id = i % world_size;
-    worker_regions[worker_id][worker_counts[worker_id]++] = all_regions[i];
+// Number of frames of the next chunk handed to rank, out of remaining: its
+// share (by speed when known) of half the remaining frames, so that chunks
+// shrink as the queue empties and the last ones finish close together
+static int next_chunk_size(int remaining, int rank, int world_size) {
+  double share = 1.0 / world_size;
+  if (g_rank_speed) {
+    double *weights = (double *)malloc(world_size * sizeof(double));
+    double total = 0.0;
+    balance_weights(g_rank_speed, world_size, weights);
+    for (int w = 0; w < world_size; w++) {
+      total += weights[w];
+    }
+    share = weights[rank] / total;
+    free(weights);
   }
 
-  free(all_regions);
+  int chunk = (int)(remaining * share / 2);
+  if (chunk < 1)
+    chunk = 1;
+  if (chunk > remaining)
+    chunk = remaining;
+  return chunk;
+}
 
-  int cmd = CMD_PROCESS_BATCH;
-  for (int w = 1; w < world_size; w++) {
-    MPI_Send(&cmd, 1, MPI_INT, w, TAG_COMMAND, MPI_COMM_WORLD);
+// Start sending worker w the next chunk of frames, if the queue is not
+// empty. Workers mapping the shared frames only get frame indices. Returns
+// the number of frames sent.
+static int send_next_chunk(Region *frames, int num_images, int *next, int w,
+                           int world_size, outbound_t *out) {
+  if (*next >= num_images) {
+    return 0;
+  }
+  int count = next_chunk_size(num_images - *next, w, world_size);
+  if (g_node_local && g_node_local[w]) {
+    outbound_start_shared(out, &frames[*next], count, w);
+  } else {
+    // Capped to what one message can hold
+    int fitting = region_message_fit(&frames[*next], count);
+    if (fitting > 0)
+      count = fitting;
+    outbound_start(out, &frames[*next], count, CMD_PROCESS_CHUNK, w);
   }
+  out->first = *next;
+  *next += count;
+  return count;
+}
 
-  for (int w = 1; w < world_size; w++) {
-    int count = worker_counts[w];
-    MPI_Send(&count, 1, MPI_INT, w, TAG_REGION_COUNT, MPI_COMM_WORLD);
+// Read the results of a chunk from worker w out of message, chunk being the
+// frames it was given. Returns them, as views into message or, if the worker
+// filtered them in place in shared memory (a count of 0), as the frames
+// themselves; *in_place tells which. The array is to be freed by the caller.
+static Region *receive_chunk(int w, char *message, Region *chunk, int count,
+                             int *in_place) {
+  message_header header;
+  Region *results = region_message_read(message, &header);
+  *in_place = header.count == 0;
+  if (*in_place) {
+    MPI_Win_sync(g_shared.win);
+    free(results);
+    results = (Region *)malloc(count * sizeof(Region));
+    memcpy(results, chunk, count * sizeof(Region));
+  }
 
-    if (count > 0) {
-      int buffer_size = calculate_batch_buffer_size(worker_regions[w], count);
-      char *buffer = (char *)malloc(buffer_size);
-      pack_regions(worker_regions[w], count, buffer, buffer_size,
-                   MPI_COMM_WORLD);
+  if (g_rank_speed) {
+    long pixels = 0;
+    for (int r = 0; r < count; r++) {
+      pixels += (long)results[r].region_width * results[r].region_height;
+    }
+    balance_update_speed(&g_rank_speed[w], pixels, header.seconds);
+  }
+  return results;
+}
 
-      MPI_Send(&buffer_size, 1, MPI_INT, w, TAG_BUFFER_SIZE, MPI_COMM_WORLD);
-      MPI_Send(buffer, buffer_size, MPI_PACKED, w, TAG_BUFFER_DATA,
-               MPI_COMM_WORLD);
+// Frames of the master's next turn, out of its share of count: those that
+// fit in MASTER_TURN_PIXELS per thread, and at least one, so that finished
+// workers get their next chunk without waiting for the whole share
+static int master_turn_size(const Region *frames, int count) {
+  long budget = (long)MASTER_TURN_PIXELS * omp_get_max_threads();
+  long pixels = (long)frames[0].region_width * frames[0].region_height;
+  int n = 1;
+  while (n < count) {
+    pixels += (long)frames[n].region_width * frames[n].region_height;
+    if (pixels > budget) {
+      break;
+    }
+    n++;
+  }
+  return n;
+}
 
-      free(buffer);
+// Filter unsplit frames from a work queue: every worker starts with a chunk
+// and gets the next one as soon as it returns its results, while the master
+// filters chunks of its own in between. Frame costs vary (blur runs until
+// convergence), so ranks pull work as they become idle instead of getting a
+// fixed share up front.
+static void process_nonsplit_images_batch(animated_gif *image,
+                                          int *image_indices, int num_images,
+                                          int world_size,
+                                          frame_stream_t *stream,
+                                          runtime_config_t config) {
+  Region *frames = (Region *)malloc(num_images * sizeof(Region));
+  for (int i = 0; i < num_images; i++) {
+    int idx = image_indices[i];
+    Region *r = Split(image->p[idx], idx, image->width[idx],
+                      image->height[idx], 1, 0, NULL);
+    frames[i] = r[0];
+    free(r);
+  }
 
-      for (int r = 0; r < count; r++) {
-        free(worker_regions[w][r].p);
-      }
+  // Frames in flight on every worker (0 once the queue had nothing left for
+  // it). Chunks are sent without blocking, each worker's message living in
+  // out[w] until its transfer completes; results come back as single
+  // messages from whichever worker is done first.
+  int *in_flight = (int *)calloc(world_size, sizeof(int));
+  outbound_t *out = (outbound_t *)calloc(world_size, sizeof(outbound_t));
+  int next = 0;
+  int busy = 0;
+  for (int w = 1; w < world_size; w++) {
+    in_flight[w] =
+        send_next_chunk(frames, num_images, &next, w, world_size, &out[w]);
+    if (in_flight[w] > 0) {
+      busy++;
     }
   }
 
-  int master_count = worker_counts[0];
+  while (next < num_images || busy > 0) {
+    // Serve a worker that has finished, or wait for one once the master has
+    // nothing left to filter itself
+    char *message = NULL;
+    MPI_Status status;
+    int size;
+    if (busy > 0) {
+      if (next < num_images) {
+        message = message_poll(MPI_ANY_SOURCE, TAG_RESULT, MPI_COMM_WORLD,
+                               &status, &size);
+      } else {
+        message = message_receive(MPI_ANY_SOURCE, TAG_RESULT, MPI_COMM_WORLD,
+                                  &status, &size);
+      }
+    }
 
-  // #pragma omp parallel for schedule(dynamic) if(config.openmp_mode != OPENMP_MODE_OFF && master_count > OPENMP_COARSE_THRESHOLD && omp_get_max_threads() > OPENMP_THREADS_THRESHOLD && worker_regions[0][0].region_width * worker_regions[0][0].region_height < OPENMP_THRESHOLD)
-  for (int r = 0; r < master_count; r++) {
-    apply_filters_with_gpu_dispatch(&worker_regions[0][r], 5, 20, config);
-  }
+    if (message) {
+      int w = status.MPI_SOURCE;
+      int count = in_flight[w];
+      int in_place;
+      Region *results =
+          receive_chunk(w, message, &frames[out[w].first], count, &in_place);
+      in_flight[w] =
+          send_next_chunk(frames, num_images, &next, w, world_size, &out[w]);
+      if (in_flight[w] == 0) {
+        busy--;
+      }
 
-  *result_count = num_images;
-  *result_regions = (Region *)malloc(num_images * sizeof(Region));
-  int result_idx = 0;
+      // The worker has its next chunk: prepare the output meanwhile
+      for (int r = 0; r < count; r++) {
+        if (in_place) {
+          stream_frame_done(stream, results[r].image_id);
+        } else {
+          stream_regions(stream, &results[r], 1);
+        }
+      }
+      free(results);
+      free(message);
+      continue;
+    }
 
-  for (int r = 0; r < master_count; r++) {
-    (*result_regions)[result_idx++] = worker_regions[0][r];
-  }
+    // Master's own turn, filtered in place through the frame views
+    int count = master_turn_size(
+        &frames[next], next_chunk_size(num_images - next, 0, world_size));
+    double start = MPI_Wtime();
+    apply_filters_batch_with_gpu_dispatch(&frames[next], count, config);
+    double seconds = MPI_Wtime() - start;
+    if (g_rank_speed) {
+      long pixels = 0;
+      for (int r = next; r < next + count; r++) {
+        pixels += (long)frames[r].region_width * frames[r].region_height;
+      }
+      balance_update_speed(&g_rank_speed[0], pixels, seconds);
+    }
 
-  for (int w = 1; w < world_size; w++) {
-    int count = worker_counts[w];
-    if (count > 0) {
-      int buffer_size;
-      MPI_Recv(&buffer_size, 1, MPI_INT, w, TAG_RESULT_SIZE, MPI_COMM_WORLD,
-               MPI_STATUS_IGNORE);
-
-      char *buffer = (char *)malloc(buffer_size);
-      MPI_Recv(buffer, buffer_size, MPI_PACKED, w, TAG_RESULT_DATA,
-               MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-      unpack_regions(&(*result_regions)[result_idx], count, buffer, buffer_size,
-                     MPI_COMM_WORLD);
-      free(buffer);
-      result_idx += count;
+    for (int r = next; r < next + count; r++) {
+      stream_frame_done(stream, frames[r].image_id);
     }
+    next += count;
   }
 
-  for (int w = 0; w < world_size; w++) {
-    free(worker_regions[w]);
+  for (int w = 1; w < world_size; w++) {
+    outbound_complete(&out[w]);
   }
-  free(worker_regions);
-  free(worker_counts);
+  free(out);
+  free(in_flight);
+  free(frames);
 }
 
 void Master(char *input_file, char *output_file, runtime_config_t config) {
@@ -331,18 +617,18 @@ switch (config.mpi_mode) {
   if (world_size == 1 || !use_mpi) {
     gettimeofday(&t1, NULL);
 
-    // #pragma omp parallel for schedule(dynamic) if(config.openmp_mode != OPENMP_MODE_OFF && n_images > OPENMP_COARSE_THRESHOLD && omp_get_max_threads() > OPENMP_THREADS_THRESHOLD && image->width[0] * image->height[0] < OPENMP_THRESHOLD)
+    // Frames are filtered in place through views, without any copy
+    Region *frames = (Region *)malloc(n_images * sizeof(Region));
     for (int i = 0; i < n_images; i++) {
       Region *regions =
-          Split(image->p[i], i, image->width[i], image->height[i], 1);
-      apply_filters_with_gpu_dispatch(&regions[0], 5, 20, config);
-      pixel *combined = Combine(regions, image->width[i], image->height[i], 1);
-      free(image->p[i]);
-      image->p[i] = combined;
-      free(regions[0].p);
+          Split(image->p[i], i, image->width[i], image->height[i], 1, 0, NULL);
+      frames[i] = regions[0];
       free(regions);
     }
 
+    apply_filters_batch_with_gpu_dispatch(frames, n_images, config);
+    free(frames);
+
     gettimeofday(&t2, NULL);
     duration = (t2.tv_sec - t1.tv_sec) + ((t2.tv_usec - t1.tv_usec) / 1e6);
     printf("SOBEL done in %lf s\n", duration);
@@ -354,12 +640,7 @@ switch (config.mpi_mode) {
       return;
     }
 
-    if (world_size > 1) {
-      int cmd = CMD_TERMINATE;
-      for (int w = 1; w < world_size; w++) {
-        MPI_Send(&cmd, 1, MPI_INT, w, TAG_COMMAND, MPI_COMM_WORLD);
-      }
-    }
+    send_command(CMD_TERMINATE, world_size);
 
     return;
   }
@@ -367,6 +648,20 @@ switch (config.mpi_mode) {
   // Multi-rank processing
   gettimeofday(&t1, NULL);
 
+  // Rank throughputs are only measured for inputs large enough to repay the
+  // calibration frame; smaller ones are shared out equally
+  long total_pixels = 0;
+  for (int i = 0; i < n_images; i++) {
+    total_pixels += (long)image->width[i] * image->height[i];
+  }
+  if (config.balance_mode == BALANCE_MODE_AUTO &&
+      total_pixels >= BALANCE_MIN_PIXELS) {
+    calibrate_ranks(world_size, config);
+  }
+  if (config.shm_mode == SHM_MODE_AUTO) {
+    share_frames(image, world_size);
+  }
+
   int *split_images = (int *)malloc(n_images * sizeof(int));
   int *nonsplit_images = (int *)malloc(n_images * sizeof(int));
   int num_split = 0;
@@ -382,91 +677,87 @@ switch (config.mpi_mode) {
         split_images[num_split++] = i;
       }
     } else {
+      // The remainder are the last frames, so that the batch ones can be
+      // streamed to the output in order while they are filtered
       int remainder = n_images % world_size;
-      for (int i = 0; i < remainder; i++) {
+      for (int i = 0; i < n_images - remainder; i++) {
+        nonsplit_images[num_nonsplit++] = i;
+      }
+      for (int i = n_images - remainder; i < n_images; i++) {
         split_images[num_split++] = i;
       }
-      for (int i = remainder; i < n_images; i++) {
+    }
+
+    // Frames too small for a block per rank to hold the chain's halo are
+    // filtered whole with the batch
+    int fitting = 0;
+    for (int s = 0; s < num_split; s++) {
+      int i = split_images[s];
+      if (filter_chain_split_fits(&config.chain, image->width[i],
+                                  image->height[i], world_size)) {
+        split_images[fitting++] = i;
+      } else {
         nonsplit_images[num_nonsplit++] = i;
       }
     }
+    num_split = fitting;
   }
 
-  Region *all_results =
-      (Region *)malloc((n_images * world_size) * sizeof(Region));
-  int total_results = 0;
-
-  // Process spliTted images one at a time (requires ghost cell sync)
-  for (int i = 0; i < num_split; i++) {
-    Region *split_results;
-    process_split_image(image, split_images[i], world_size, &split_results, config);
-
-    for (int r = 0; r < world_size; r++) {
-      all_results[total_results++] = split_results[r];
-    }
-    free(split_results);
+  frame_stream_t stream = {image, store_begin(image),
+                           (char *)calloc(n_images > 0 ? n_images : 1, 1), 0, 1};
+  if (!stream.store) {
+    fprintf(stderr, "Master: Failed to store GIF to %s\n", output_file);
+    MPI_Abort(MPI_COMM_WORLD, 1);
   }
 
-  // Process non-splitted images as a batch (no ghost cell sync needed)
+  // Process non-splitted images as a batch (no ghost cell sync needed).
+  // Batches go first: their timings refine the rank speeds used to size the
+  // blocks of split images.
   if (num_nonsplit > 0) {
-    Region *batch_results;
-    int batch_count;
     process_nonsplit_images_batch(image, nonsplit_images, num_nonsplit,
-                                  world_size, &batch_results, &batch_count, config);
-
-    for (int r = 0; r < batch_count; r++) {
-      all_results[total_results++] = batch_results[r];
-    }
-    free(batch_results);
+                                  world_size, &stream, config);
   }
 
-  int cmd = CMD_TERMINATE;
-  for (int w = 1; w < world_size; w++) {
-    MPI_Send(&cmd, 1, MPI_INT, w, TAG_COMMAND, MPI_COMM_WORLD);
+  // Process spliTted images one at a time (requires ghost cell sync). With
+  // collectives the workers are told once, then every size MPI_Scatter
+  // starts a frame, until one of zeros releases them.
+  int scattered = num_split > 0 && use_collectives(world_size, config);
+  if (scattered) {
+    send_command(CMD_SCATTER_SPLIT_IMAGE, world_size);
   }
+  for (int i = 0; i < num_split; i++) {
+    process_split_image(image, split_images[i], world_size, &stream, config);
+  }
+  if (scattered) {
+    int *sizes = (int *)calloc(world_size, sizeof(int));
+    MPI_Scatter(sizes, 1, MPI_INT, MPI_IN_PLACE, 1, MPI_INT, 0,
+                MPI_COMM_WORLD);
+    free(sizes);
+  }
+
+  send_command(CMD_TERMINATE, world_size);
 
   gettimeofday(&t2, NULL);
   duration = (t2.tv_sec - t1.tv_sec) + ((t2.tv_usec - t1.tv_usec) / 1e6);
   printf("SOBEL done in %lf s\n", duration);
 
-  gettimeofday(&t1, NULL);
-
-  // Sort results by image_id then  by region_id
-  qsort(all_results, total_results, sizeof(Region), compare_regions);
-
-  int region_idx = 0;
-  for (int i = 0; i < n_images; i++) {
-    int start_idx = region_idx;
-    int image_region_count = 0;
-
-    while (region_idx < total_results &&
-           all_results[region_idx].image_id == i) {
-      image_region_count++;
-      region_idx++;
-    }
-
-    if (image_region_count == 0) {
-      fprintf(stderr, "Master: No regions found for image %d\n", i);
-      continue;
-    }
+  free(split_images);
+  free(nonsplit_images);
+  free(stream.done);
 
-    int k_regions = all_results[start_idx].k_regions;
-    pixel *combined = Combine(&all_results[start_idx], image->width[i],
-                              image->height[i], k_regions);
-
-    free(image->p[i]);
-    image->p[i] = combined;
-
-    for (int r = start_idx; r < start_idx + image_region_count; r++) {
-      if (all_results[r].p) {
-        free(all_results[r].p);
-        all_results[r].p = NULL;
-      }
-    }
-  }
-
-  if (!store_pixels(output_file, image)) {
+  // Every frame has been handed to the store while the others were filtered:
+  // only the color map and the encoding are left
+  if (!stream.ok || !store_end(stream.store, output_file, image)) {
     fprintf(stderr, "Master: Failed to store GIF to %s\n", output_file);
     MPI_Abort(MPI_COMM_WORLD, 1);
   }
+
+  // The workers of this node wait for the windows to be released
+  region_window_free(split_window());
+  shared_frames_free(&g_shared);
+  free(g_node_local);
+  g_node_local = NULL;
+
+  free(g_rank_speed);
+  g_rank_speed = NULL;
 }
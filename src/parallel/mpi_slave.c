@@ -1,7 +1,11 @@
 #include "gif_model.h"
+#include "mpi_protocol.h"
+#include "rank_balance.h"
 #include "region_filter.h"
+#include "region_message.h"
 #include "split.h"
 #include "runtime_config.h"
+#include "shared_frames.h"
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,153 +13,118 @@
 
 #include "sobel_cuda.h"
 
-#define TAG_COMMAND 0
-#define TAG_REGION_COUNT 1
-#define TAG_BUFFER_SIZE 2
-#define TAG_BUFFER_DATA 3
-#define TAG_RESULT_SIZE 4
-#define TAG_RESULT_DATA 5
-
-#define CMD_PROCESS_SPLIT_IMAGE 1
-#define CMD_PROCESS_BATCH 2
-#define CMD_TERMINATE 3
-
 // Global flag for GPU availability, set once at startup
 static int g_use_gpu = 0;
 
-static int calculate_batch_buffer_size(Region *regions, int count) {
-  int total_size = 0;
-  for (int i = 0; i < count; i++) {
-    total_size += 5 * sizeof(int); // metadata
-    total_size +=
-        regions[i].region_width * regions[i].region_height * sizeof(pixel);
-  }
-  return total_size;
-}
+// Frames shared by the master when this rank runs on its node
+static shared_frames g_shared = {.node = MPI_COMM_NULL};
 
-static void pack_regions(Region *regions, int count, char *buffer,
-                         int buffer_size, MPI_Comm comm) {
-  int position = 0;
-  for (int i = 0; i < count; i++) {
-    int metadata[5] = {regions[i].image_id, regions[i].region_id,
-                       regions[i].region_width, regions[i].region_height,
-                       regions[i].k_regions};
-    MPI_Pack(metadata, 5, MPI_INT, buffer, buffer_size, &position, comm);
-
-    int pixel_count = regions[i].region_width * regions[i].region_height;
-    MPI_Pack(regions[i].p, pixel_count * sizeof(pixel), MPI_BYTE, buffer,
-             buffer_size, &position, comm);
-  }
+// Apply the filter chain to a batch of unsplit regions with GPU dispatch for
+// all filters if available
+static void apply_filters_batch_with_gpu_dispatch(Region *regions, int count,
+                                                  runtime_config_t config) {
+  apply_filter_chain_to_regions_gpu(regions, count, g_use_gpu, config);
 }
 
-static void unpack_regions(Region *regions, int count, char *buffer,
-                           int buffer_size, MPI_Comm comm) {
-  int position = 0;
-  for (int i = 0; i < count; i++) {
-    int metadata[5];
-    MPI_Unpack(buffer, buffer_size, &position, metadata, 5, MPI_INT, comm);
+// Receive the block of a split image from the matched message, into this
+// rank's slot of the split window when there is one, filter it and send it
+// back in place as the result
+static void handle_split_image(MPI_Message *matched, MPI_Status *status,
+                               runtime_config_t config) {
+  int size;
+  MPI_Get_count(status, MPI_BYTE, &size);
+  char *slot = split_block_slot(size, config);
+  char *message = slot ? slot : (char *)malloc(size);
+  if (!message) {
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+  MPI_Mrecv(message, size, MPI_BYTE, matched, MPI_STATUS_IGNORE);
 
-    regions[i].image_id = metadata[0];
-    regions[i].region_id = metadata[1];
-    regions[i].region_width = metadata[2];
-    regions[i].region_height = metadata[3];
-    regions[i].k_regions = metadata[4];
+  message_header header;
+  Region *region = region_message_read(message, &header);
 
-    int pixel_count = regions[i].region_width * regions[i].region_height;
-    regions[i].p = (pixel *)malloc(pixel_count * sizeof(pixel));
+  filter_split_region(region, g_use_gpu, config);
 
-    MPI_Unpack(buffer, buffer_size, &position, regions[i].p,
-               pixel_count * sizeof(pixel), MPI_BYTE, comm);
+  MPI_Send(message, size, MPI_BYTE, 0, TAG_RESULT, MPI_COMM_WORLD);
+  free(region);
+  if (!slot) {
+    free(message);
   }
 }
 
-// Apply filters with GPU dispatch for all filters if available
-static void apply_filters_with_gpu_dispatch(Region *region, int blur_size,
-                                            int blur_threshold, runtime_config_t config) {
-  apply_all_filters_to_region_gpu(region, blur_size, blur_threshold, g_use_gpu, config);
-}
-
-// Apply filters with MPI sync and GPU dispatch for all filters if available
-static void apply_filters_mpi_with_gpu_dispatch(Region *region, int blur_size,
-                                                int blur_threshold,
-                                                MPI_Comm comm, runtime_config_t config) {
-  apply_all_filters_to_region_mpi_gpu(region, blur_size, blur_threshold, comm,
-                                      g_use_gpu, config);
-}
-
-// Handle processing of a split image (with ghost cell synchronization)
-static void handle_split_image(int rank, runtime_config_t config) {
-  int buffer_size;
-  MPI_Recv(&buffer_size, 1, MPI_INT, 0, TAG_BUFFER_SIZE, MPI_COMM_WORLD,
-           MPI_STATUS_IGNORE);
-
-  char *recv_buffer = (char *)malloc(buffer_size);
-  MPI_Recv(recv_buffer, buffer_size, MPI_PACKED, 0, TAG_BUFFER_DATA,
-           MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-  Region region;
-  unpack_regions(&region, 1, recv_buffer, buffer_size, MPI_COMM_WORLD);
-  free(recv_buffer);
+// Same as handle_split_image for every split image until the master is done
+// with them, the blocks coming from MPI_Scatterv and going back through
+// MPI_Gatherv (see scatter_blocks in mpi_master.c). A size of 0 ends it.
+static void handle_scattered_split_images(runtime_config_t config) {
+  while (1) {
+    int size;
+    MPI_Scatter(NULL, 1, MPI_INT, &size, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (size == 0) {
+      return;
+    }
 
-  apply_filters_mpi_with_gpu_dispatch(&region, 5, 20, MPI_COMM_WORLD, config);
-  int send_buffer_size = calculate_batch_buffer_size(&region, 1);
-  char *send_buffer = (char *)malloc(send_buffer_size);
-  pack_regions(&region, 1, send_buffer, send_buffer_size, MPI_COMM_WORLD);
+    char *slot = split_block_slot(size, config);
+    char *message = slot ? slot : (char *)malloc(size);
+    if (!message) {
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Scatterv(NULL, NULL, NULL, MPI_BYTE, message, size, MPI_BYTE, 0,
+                 MPI_COMM_WORLD);
 
-  MPI_Send(&send_buffer_size, 1, MPI_INT, 0, TAG_RESULT_SIZE, MPI_COMM_WORLD);
-  MPI_Send(send_buffer, send_buffer_size, MPI_PACKED, 0, TAG_RESULT_DATA,
-           MPI_COMM_WORLD);
+    message_header header;
+    Region *region = region_message_read(message, &header);
 
-  free(send_buffer);
-  free(region.p);
-}
+    filter_split_region(region, g_use_gpu, config);
 
-static void handle_batch(int rank, runtime_config_t config) {
-  int region_count;
-  MPI_Recv(&region_count, 1, MPI_INT, 0, TAG_REGION_COUNT, MPI_COMM_WORLD,
-           MPI_STATUS_IGNORE);
+    MPI_Gather(&size, 1, MPI_INT, NULL, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Gatherv(message, size, MPI_BYTE, NULL, NULL, NULL, MPI_BYTE, 0,
+                MPI_COMM_WORLD);
 
-  if (region_count <= 0) {
-    return;
+    free(region);
+    if (!slot) {
+      free(message);
+    }
   }
+}
 
-  int buffer_size;
-  MPI_Recv(&buffer_size, 1, MPI_INT, 0, TAG_BUFFER_SIZE, MPI_COMM_WORLD,
-           MPI_STATUS_IGNORE);
-
-  char *recv_buffer = (char *)malloc(buffer_size);
-  MPI_Recv(recv_buffer, buffer_size, MPI_PACKED, 0, TAG_BUFFER_DATA,
-           MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-  Region *regions = (Region *)malloc(region_count * sizeof(Region));
-  unpack_regions(regions, region_count, recv_buffer, buffer_size,
-                 MPI_COMM_WORLD);
-  free(recv_buffer);
-
-  // #pragma omp parallel for schedule(dynamic) if(openmp_mode != OPENMP_MODE_OFF && region_count > OPENMP_COARSE_THRESHOLD && omp_get_max_threads() > OPENMP_THREADS_THRESHOLD && regions[0].region_width * regions[0].region_height < OPENMP_THRESHOLD)
-  for (int r = 0; r < region_count; r++) {
-    apply_filters_with_gpu_dispatch(&regions[r], 5, 20, config);
+// Filter a chunk of frames from the master's work queue, carried by message
+// (size bytes), and send them back in place along with the compute time,
+// from which the master refines this rank's throughput. When the frames are
+// in the shared arena, the message only holds their indices, and the reply
+// only the time (a count of 0).
+static void handle_chunk(char *message, int size, runtime_config_t config) {
+  message_header header;
+  Region *regions;
+  if (g_shared.node != MPI_COMM_NULL) {
+    memcpy(&header, message, sizeof(header));
+    regions = shared_frames_views(
+        &g_shared, (const int *)(message + sizeof(header)), header.count);
+    MPI_Win_sync(g_shared.win);
+  } else {
+    regions = region_message_read(message, &header);
   }
 
-  int send_buffer_size = calculate_batch_buffer_size(regions, region_count);
-  char *send_buffer = (char *)malloc(send_buffer_size);
-  pack_regions(regions, region_count, send_buffer, send_buffer_size,
-               MPI_COMM_WORLD);
-
-  MPI_Send(&send_buffer_size, 1, MPI_INT, 0, TAG_RESULT_SIZE, MPI_COMM_WORLD);
-  MPI_Send(send_buffer, send_buffer_size, MPI_PACKED, 0, TAG_RESULT_DATA,
-           MPI_COMM_WORLD);
+  double start = MPI_Wtime();
+  apply_filters_batch_with_gpu_dispatch(regions, header.count, config);
+  double seconds = MPI_Wtime() - start;
 
-  free(send_buffer);
-
-  for (int r = 0; r < region_count; r++) {
-    if (regions[r].p) {
-      free(regions[r].p);
-    }
+  if (g_shared.node != MPI_COMM_NULL) {
+    message_header reply = {0, seconds};
+    MPI_Win_sync(g_shared.win);
+    MPI_Send(&reply, sizeof(reply), MPI_BYTE, 0, TAG_RESULT, MPI_COMM_WORLD);
+  } else {
+    ((message_header *)message)->seconds = seconds;
+    MPI_Send(message, size, MPI_BYTE, 0, TAG_RESULT, MPI_COMM_WORLD);
   }
   free(regions);
 }
 
+// Measure this rank's throughput and gather it on the master
+static void handle_calibrate(runtime_config_t config) {
+  double speed = balance_calibrate(&config.chain, config.openmp_mode);
+  MPI_Gather(&speed, 1, MPI_DOUBLE, NULL, 0, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+}
+
 void Slave(runtime_config_t config) {
   int rank;
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
@@ -173,20 +142,45 @@ void Slave(runtime_config_t config) {
   }
 
   while (1) {
-    int cmd;
-    MPI_Recv(&cmd, 1, MPI_INT, 0, TAG_COMMAND, MPI_COMM_WORLD,
-             MPI_STATUS_IGNORE);
+    // Commands and their data come in one message, the command as its tag
+    MPI_Message matched;
+    MPI_Status status;
+    MPI_Mprobe(0, MPI_ANY_TAG, MPI_COMM_WORLD, &matched, &status);
+    int cmd = status.MPI_TAG;
+    if (cmd == CMD_PROCESS_SPLIT_IMAGE) {
+      // Received into the split window rather than a buffer of its own
+      handle_split_image(&matched, &status, config);
+      continue;
+    }
+    int size;
+    char *message = message_receive_matched(&matched, &status, &size);
 
     switch (cmd) {
-    case CMD_PROCESS_SPLIT_IMAGE:
-      handle_split_image(rank, config);
+    case CMD_SCATTER_SPLIT_IMAGE:
+      handle_scattered_split_images(config);
       break;
 
-    case CMD_PROCESS_BATCH:
-      handle_batch(rank, config);
+    case CMD_PROCESS_CHUNK:
+      handle_chunk(message, size, config);
       break;
 
+    case CMD_CALIBRATE:
+      handle_calibrate(config);
+      break;
+
+    case CMD_SHARE_FRAMES: {
+      MPI_Comm node = shared_frames_node(MPI_COMM_WORLD);
+      if (node != MPI_COMM_NULL) {
+        shared_frames_attach(&g_shared, node);
+      }
+      break;
+    }
+
     case CMD_TERMINATE:
+      // Released together with the master once it has stored the frames
+      free(message);
+      region_window_free(split_window());
+      shared_frames_free(&g_shared);
       return;
 
     default:
@@ -194,5 +188,6 @@ void Slave(runtime_config_t config) {
       MPI_Abort(MPI_COMM_WORLD, 1);
       return;
     }
+    free(message);
   }
 }
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <sys/time.h>
 
+#include "cpu_dispatch.h"
 #include "runtime_config.h"
 
 
@@ -12,17 +13,31 @@ static void print_usage(const char *prog) {
           "Usage: %s [--mpi off|auto|full|hybrid] "
           "[--openmp off|auto|force] "
           "[--cuda off|auto|force] "
-          "input.gif output.gif\n",
-          prog);
+          "[--chain STAGES | --chain-file FILE] "
+          "[--kernel auto|generic|avx2|avx512] "
+          "[--balance off|auto] "
+          "[--shm off|auto] "
+          "[--collective off|auto|force] "
+          "input.gif output.gif\n"
+          "  STAGES: comma-separated list of gray, blur[:radius[:threshold]],\n"
+          "          sobel[:threshold] (default: %s)\n",
+          prog, FILTER_CHAIN_DEFAULT);
 }
 
 static int parse_args(int argc, char **argv,
                       runtime_config_t *cfg,
                       char **input_filename,
-                      char **output_filename) {
+                      char **output_filename,
+                      char **chain_spec,
+                      char **chain_file,
+                      kernel_isa_t *kernel) {
   cfg->mpi_mode = MPI_MODE_AUTO;
   cfg->openmp_mode = OPENMP_MODE_AUTO;
   cfg->cuda_mode = CUDA_MODE_AUTO;
+  cfg->balance_mode = BALANCE_MODE_AUTO;
+  cfg->shm_mode = SHM_MODE_AUTO;
+  cfg->collective_mode = COLLECTIVE_MODE_AUTO;
+  *kernel = kernel_isa_best();
 
   int positional = 0;
 
@@ -49,6 +64,34 @@ static int parse_args(int argc, char **argv,
       else if (strcmp(argv[i], "auto") == 0) cfg->cuda_mode = CUDA_MODE_AUTO;
       else if (strcmp(argv[i], "force") == 0) cfg->cuda_mode = CUDA_MODE_FORCE;
       else return 0;
+    } else if (strcmp(argv[i], "--chain") == 0) {
+      if (i + 1 >= argc || *chain_file) return 0;
+      *chain_spec = argv[++i];
+    } else if (strcmp(argv[i], "--chain-file") == 0) {
+      if (i + 1 >= argc || *chain_spec) return 0;
+      *chain_file = argv[++i];
+    } else if (strcmp(argv[i], "--kernel") == 0) {
+      if (i + 1 >= argc) return 0;
+      if (!kernel_isa_parse(argv[++i], kernel)) return 0;
+    } else if (strcmp(argv[i], "--balance") == 0) {
+      if (i + 1 >= argc) return 0;
+      i++;
+      if (strcmp(argv[i], "off") == 0) cfg->balance_mode = BALANCE_MODE_OFF;
+      else if (strcmp(argv[i], "auto") == 0) cfg->balance_mode = BALANCE_MODE_AUTO;
+      else return 0;
+    } else if (strcmp(argv[i], "--shm") == 0) {
+      if (i + 1 >= argc) return 0;
+      i++;
+      if (strcmp(argv[i], "off") == 0) cfg->shm_mode = SHM_MODE_OFF;
+      else if (strcmp(argv[i], "auto") == 0) cfg->shm_mode = SHM_MODE_AUTO;
+      else return 0;
+    } else if (strcmp(argv[i], "--collective") == 0) {
+      if (i + 1 >= argc) return 0;
+      i++;
+      if (strcmp(argv[i], "off") == 0) cfg->collective_mode = COLLECTIVE_MODE_OFF;
+      else if (strcmp(argv[i], "auto") == 0) cfg->collective_mode = COLLECTIVE_MODE_AUTO;
+      else if (strcmp(argv[i], "force") == 0) cfg->collective_mode = COLLECTIVE_MODE_FORCE;
+      else return 0;
     } else if (argv[i][0] == '-') {
       return 0;
     } else {
@@ -94,20 +137,88 @@ static const char *cuda_mode_name(cuda_mode_t mode) {
   }
 }
 
+static const char *balance_mode_name(balance_mode_t mode) {
+  switch (mode) {
+    case BALANCE_MODE_OFF:  return "off";
+    case BALANCE_MODE_AUTO:
+    default:                return "auto";
+  }
+}
+
+static const char *shm_mode_name(shm_mode_t mode) {
+  switch (mode) {
+    case SHM_MODE_OFF:  return "off";
+    case SHM_MODE_AUTO:
+    default:            return "auto";
+  }
+}
+
+static const char *collective_mode_name(collective_mode_t mode) {
+  switch (mode) {
+    case COLLECTIVE_MODE_OFF:   return "off";
+    case COLLECTIVE_MODE_FORCE: return "force";
+    case COLLECTIVE_MODE_AUTO:
+    default:                    return "auto";
+  }
+}
+
+// Build the filter chain on rank 0 (the chain file only has to be readable
+// there) and share it with every rank. Returns 0 on all ranks if it is invalid.
+static int setup_filter_chain(int rank, const char *chain_spec,
+                              const char *chain_file, filter_chain_t *chain) {
+  int ok = 1;
+  if (rank == 0) {
+    if (chain_file) {
+      ok = filter_chain_load(chain_file, chain);
+    } else {
+      ok = filter_chain_parse(chain_spec ? chain_spec : FILTER_CHAIN_DEFAULT,
+                              chain);
+    }
+    if (ok) {
+      filter_chain_plan(chain);
+    }
+  }
+
+  MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (ok) {
+    MPI_Bcast(chain, sizeof(*chain), MPI_BYTE, 0, MPI_COMM_WORLD);
+  }
+  return ok;
+}
+
 extern void Master(char *input_file, char *output_file, runtime_config_t config);
 extern void Slave(runtime_config_t config);
 
 int main(int argc, char **argv) {
   char *input_filename = NULL;
   char *output_filename = NULL;
+  char *chain_spec = NULL;
+  char *chain_file = NULL;
   int rank, size;
   runtime_config_t config;
+  int provided;
+  kernel_isa_t kernel;
 
-  MPI_Init(&argc, &argv);
+  // Split-image blur calls MPI from the master thread of an OpenMP region
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   MPI_Comm_size(MPI_COMM_WORLD, &size);
+  if (provided < MPI_THREAD_FUNNELED) {
+    fprintf(stderr, "Rank %d: MPI library does not support "
+                    "MPI_THREAD_FUNNELED\n", rank);
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+
+  if (!parse_args(argc, argv, &config, &input_filename, &output_filename,
+                  &chain_spec, &chain_file, &kernel)) {
+    if (rank == 0) {
+      print_usage(argv[0]);
+    }
+    MPI_Finalize();
+    return 1;
+  }
 
-  if (!parse_args(argc, argv, &config, &input_filename, &output_filename)) {
+  if (!setup_filter_chain(rank, chain_spec, chain_file, &config.chain)) {
     if (rank == 0) {
       print_usage(argv[0]);
     }
@@ -115,11 +226,25 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  // Every rank runs its own kernels, so every rank checks its own CPU
+  if (!kernel_isa_select(kernel)) {
+    fprintf(stderr, "Rank %d: CPU does not support %s kernels\n", rank,
+            kernel_isa_name(kernel));
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+
   if (rank == 0) {
-    printf("Config: mpi=%s, openmp=%s, cuda=%s\n",
+    char chain_text[512];
+    filter_chain_format(&config.chain, chain_text, sizeof(chain_text));
+    printf("Config: mpi=%s, openmp=%s, cuda=%s, chain=%s, kernel=%s, "
+           "balance=%s, shm=%s, collective=%s\n",
            mpi_mode_name(config.mpi_mode),
            openmp_mode_name(config.openmp_mode),
-           cuda_mode_name(config.cuda_mode));
+           cuda_mode_name(config.cuda_mode), chain_text,
+           kernel_isa_name(kernel_isa()),
+           balance_mode_name(config.balance_mode),
+           shm_mode_name(config.shm_mode),
+           collective_mode_name(config.collective_mode));
   }
 
   if (rank == 0) {
@@ -9,10 +9,6 @@ extern "C" {
 #include "gif_model.h"
 }
 
-#ifndef GHOST_WIDTH
-#define GHOST_WIDTH 5
-#endif
-
 #define MIN_PIXELS_FOR_GPU (128 * 128)
 
 #define BLOCK_SIZE 16
@@ -150,7 +146,8 @@ __global__ void convergence_kernel(const pixel *__restrict__ current,
 }
 
 __global__ void sobel_kernel(const pixel *__restrict__ source,
-                             pixel *__restrict__ dest, int width, int height) {
+                             pixel *__restrict__ dest, int width, int height,
+                             float threshold) {
   extern __shared__ pixel shared_section[];
   int tx = threadIdx.x, ty = threadIdx.y;
   int x = blockIdx.x * blockDim.x + tx;
@@ -201,7 +198,7 @@ __global__ void sobel_kernel(const pixel *__restrict__ source,
   float magnitude =
       sqrtf((float)(gradient_x * gradient_x + gradient_y * gradient_y)) / 4.0f;
   int index = y * width + x;
-  int value = (magnitude > 50.0f) ? 255 : 0;
+  int value = (magnitude > threshold) ? 255 : 0;
   dest[index].r = dest[index].g = dest[index].b = value;
 }
 
@@ -264,7 +261,8 @@ extern "C" void apply_gray_filter_to_region_cuda(pixel *pixels, int width,
 extern "C" void apply_blur_filter_to_region_cuda(pixel *pixels, int width,
                                                  int height, int radius,
                                                  int threshold, int region_id,
-                                                 int num_regions) {
+                                                 int num_regions,
+                                                 int ghost_width) {
   if (!pixels || width <= 0 || height <= 0)
     return;
   int num_pixels = width * height;
@@ -279,9 +277,10 @@ extern "C" void apply_blur_filter_to_region_cuda(pixel *pixels, int width,
   memcpy(host_input, pixels, bytes);
   cudaMemcpy(device_current, host_input, bytes, cudaMemcpyHostToDevice);
 
-  int col_start = (region_id == 0) ? 1 : GHOST_WIDTH;
+  // Ghost columns belong to the neighbours and are not blurred here
+  int col_start = (region_id == 0) ? 1 : ghost_width;
   int col_end =
-      (region_id == num_regions - 1) ? width - 1 : width - GHOST_WIDTH;
+      (region_id == num_regions - 1) ? width - 1 : width - ghost_width;
   int blur_col_start = (col_start > radius) ? col_start : radius;
   int blur_col_end = (col_end < width - radius) ? col_end : width - radius;
 
@@ -337,7 +336,8 @@ extern "C" void apply_blur_filter_to_region_cuda(pixel *pixels, int width,
 }
 
 extern "C" void apply_sobel_filter_to_region_cuda(pixel *pixels, int width,
-                                                  int height, int ghost_width,
+                                                  int height, int threshold,
+                                                  int ghost_width,
                                                   int region_id,
                                                   int num_regions) {
   if (!pixels || width <= 0 || height <= 0)
@@ -362,7 +362,7 @@ extern "C" void apply_sobel_filter_to_region_cuda(pixel *pixels, int width,
                    southwest + southeast;
         float dy = southeast + 2.0f * south + southwest - northeast -
                    2.0f * north - northwest;
-        int value = (sqrtf(dx * dx + dy * dy) / 4.0f) > 50 ? 255 : 0;
+        int value = (sqrtf(dx * dx + dy * dy) / 4.0f) > threshold ? 255 : 0;
         temp[CONV(j, k, width)] = {value, value, value};
       }
     int col_start = (region_id == 0) ? 1 : ghost_width;
@@ -385,7 +385,7 @@ extern "C" void apply_sobel_filter_to_region_cuda(pixel *pixels, int width,
   dim3 block(16, 16), grid((width + 15) / 16, (height + 15) / 16);
   size_t shared_memory = (size_t)(16 + 2) * (16 + 2) * sizeof(pixel);
   sobel_kernel<<<grid, block, shared_memory>>>(device_current, device_next,
-                                               width, height);
+                                               width, height, (float)threshold);
   cudaDeviceSynchronize();
 
   cudaMemcpy(host_output, device_next, bytes, cudaMemcpyDeviceToHost);
@@ -412,7 +412,7 @@ extern "C" void apply_sobel_filter_cuda(animated_gif *image) {
     memcpy(host_input, image->p[i], bytes);
     cudaMemcpy(device_current, host_input, bytes, cudaMemcpyHostToDevice);
     sobel_kernel<<<grid, block, shared_memory>>>(device_current, device_next,
-                                                 width, height);
+                                                 width, height, 50.0f);
     cudaDeviceSynchronize();
     cudaMemcpy(host_output, device_next, bytes, cudaMemcpyDeviceToHost);
     for (int j = 1; j < height - 1; j++)